@@ -2,10 +2,23 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdbool.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <float.h>
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <dirent.h>
+#include <time.h>
 
 
-#define MAX_LEXEME_LENGTH 256
-#define KEYWORD_COUNT 16 // Total number of keywords; can be made dynamic if needed
+#define KEYWORD_COUNT 18 // Total number of keywords; can be made dynamic if needed
 
 //input classification functions (renamed to avoid clashing with libc)
 static bool is_alpha(char input){
@@ -67,13 +80,92 @@ typedef enum {
     Token_Delim_Period
 } Token_Type; 
 
+#define TOKEN_TYPE_COUNT (Token_Delim_Period + 1)
+
+const char* tokenTypeNames[TOKEN_TYPE_COUNT] = {
+    "Token_Identifier", "Token_Character", "Token_String", "Token_Number",
+    "Token_Operator", "Token_CodeEnd", "Token_Unknown", "Token_Delimeter",
+    "Token_Single_Line_Comment", "Token_Block_Comment", "Token_Arithmetic_Operator",
+    "Token_Boolean_Operator", "Token_Assignment_Operator", "Token_Arithmetic_Operator_DIV",
+    "Token_Builtin_Constant", "Token_Keyword_If", "Token_Keyword_Else", "Token_Keyword_ElseIf",
+    "Token_Keyword_For", "Token_Keyword_Int", "Token_Keyword_Decimal", "Token_Keyword_Char",
+    "Token_Keyword_String", "Token_Keyword_Boolean", "Token_Keyword_Read", "Token_Keyword_Write",
+    "Token_Reserved_True", "Token_Reserved_False", "Token_Reserved_Null", "Token_Noise_Do",
+    "Token_Delim_LPAR", "Token_Delim_RPAR", "Token_Delim_LBRAC", "Token_Delim_RBRAC",
+    "Token_Delim_LBRAK", "Token_Delim_RBRAK", "Token_Delim_Comma", "Token_Delim_SQuote",
+    "Token_Delim_DQuote", "Token_Delim_Period"
+};
+
+// Diagnostics carried by Token_Unknown tokens
+typedef enum {
+    Diag_None,
+    Diag_Unclosed_Char,
+    Diag_Empty_Char,
+    Diag_Multi_Char,
+    Diag_Invalid_Escape,
+    Diag_Unclosed_String,
+    Diag_Unclosed_Block_Comment,
+    Diag_Number_Overflow,
+    Diag_Invalid_Utf8
+} Lexer_Diagnostic;
+
+#define DIAG_COUNT (Diag_Invalid_Utf8 + 1)
+
+const char* diagnosticMessages[DIAG_COUNT] = {
+    "",
+    "Unclosed Char",
+    "Empty char literal",
+    "Multi-character literal",
+    "Invalid escape sequence",
+    "Unclosed String",
+    "Unclosed block comment",
+    "Number literal out of range",
+    "Invalid UTF-8 sequence"
+};
+
+// Token flags
+#define TOKEN_HAS_ESCAPES 0x01  // string/char body contains a backslash escape
+#define TOKEN_DECIMAL     0x02  // Token_Number holds value.decimal, not value.integer
+
 // Token Structure
+// The lexeme is not copied: offset/length point into the input buffer.
+// Tokens carry no line numbers; a LineIndex resolves offsets on demand.
+// String and char tokens span the raw literal body without the quotes;
+// decodeLiteral() resolves escapes on demand. Number tokens carry their
+// parsed value.
+typedef union {
+    long long integer;
+    double decimal;
+} TokenValue;
+
 typedef struct {
-    Token_Type type;
-    char lexeme[MAX_LEXEME_LENGTH];
-    int line_number;
+    unsigned char type;       // Token_Type
+    unsigned char diagnostic; // Lexer_Diagnostic, only set on Token_Unknown
+    unsigned char flags;      // TOKEN_* flags
+    int offset;
+    int length;
+    unsigned int symbol;      // interned ID of a Token_Identifier, 0 if not interned
+    TokenValue value;         // Token_Number only
 } Token;
 
+// Token Stream (structure of arrays, one allocation for all columns)
+typedef struct {
+    const char* source;
+    unsigned char* types;
+    unsigned char* diagnostics;
+    unsigned char* flags;
+    int* offsets;
+    int* lengths;
+    unsigned int* symbols;
+    TokenValue* values;
+    int count;
+    int capacity;
+    int maxTokens;  // every token but Token_CodeEnd consumes a byte
+    int sourceLength;
+    void* block;
+    struct SymbolTable* symbolTable;  // table the symbol IDs refer to, if any
+} TokenStream;
+
 // Keyword Structure
 typedef struct{
     char* word;
@@ -97,43 +189,555 @@ Keyword keywords[] = {
     {"false", Token_Reserved_False},
     {"null", Token_Reserved_Null},
     {"do", Token_Noise_Do},
-    {"DIV", Token_Arithmetic_Operator_DIV}
+    {"DIV", Token_Arithmetic_Operator_DIV},
+    {"or", Token_Boolean_Operator},
+    {"and", Token_Boolean_Operator}
 };
 
+_Static_assert(sizeof(keywords) / sizeof(keywords[0]) == KEYWORD_COUNT, "KEYWORD_COUNT must match keywords[]");
+
 // Function Prototypes
-Token_Type getlexemeType(const char* lexeme);
+Token_Type getlexemeType(const char* lexeme, int length);
+void initKeywordSlots();
+int tokenSpanStart(Token token);
+bool growTokenStream(TokenStream* stream, int capacity);
+void initDfaTables();
 
-//Helper Functions for getNextToken
-const char *inputStream;
-int streamIndex = 0;
-int currentLine = 1;
+//Arena
+// Bump allocator for data that lives as long as its owner (a symbol table,
+// a lexer). Blocks are chained and freed together.
+#define ARENA_BLOCK_SIZE (64 * 1024)
 
-char peekChar(){
-    if (!inputStream) return '\0';
-    char c = inputStream[streamIndex];
-    if (c == '\0') return '\0';
-    return c;
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock* head;
+} Arena;
+
+void initArena(Arena* arena){
+    arena->head = NULL;
 }
 
-char getChar() {
-    if (!inputStream) return '\0';
-    char c = inputStream[streamIndex];
-    if (c == '\0') return '\0';
-    streamIndex++;
-    if (c == '\n') {
-        currentLine++;
+void* arenaAlloc(Arena* arena, size_t size){
+    ArenaBlock* block = arena->head;
+    if(!block || block->size - block->used < size){
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        block = malloc(sizeof(ArenaBlock) + blockSize);
+        if(!block) return NULL;
+        block->next = arena->head;
+        block->used = 0;
+        block->size = blockSize;
+        arena->head = block;
     }
-    return c;
+    void* memory = block->data + block->used;
+    block->used += size;
+    return memory;
 }
-Token createToken(Token_Type type, const char* lexemeStart, int len) {
-    Token token;
-    token.type = type;
-    token.line_number = currentLine;
-    strncpy(token.lexeme, lexemeStart, len);
-    token.lexeme[len] = '\0'; 
-    return token;
+
+void freeArena(Arena* arena){
+    while(arena->head){
+        ArenaBlock* next = arena->head->next;
+        free(arena->head);
+        arena->head = next;
+    }
+}
+//Arena
+
+//Hashing
+// Fast 64-bit hash, eight bytes per step
+unsigned long long hashBytes(const void* data, size_t length, unsigned long long seed){
+    const unsigned char* p = data;
+    unsigned long long h = seed ^ (length * 0x9E3779B97F4A7C15ULL);
+    unsigned long long v;
+    while(length >= 8){
+        memcpy(&v, p, 8);
+        h = (h ^ v) * 0xBF58476D1CE4E5B9ULL;
+        h ^= h >> 31;
+        p += 8;
+        length -= 8;
+    }
+    if(length > 0){
+        v = 0;
+        memcpy(&v, p, length);
+        h = (h ^ v) * 0x94D049BB133111EBULL;
+        h ^= h >> 29;
+    }
+    h *= 0xBF58476D1CE4E5B9ULL;
+    return h ^ (h >> 32);
+}
+//Hashing
+
+//Symbol Table
+// Interns identifier names: each distinct name is stored once in the arena
+// and gets a dense ID starting at 1 (0 means "no symbol"), so comparing
+// identifiers is an integer compare. Open addressing with linear probing,
+// kept at most half full. A table is not locked; share it between threads
+// only with external synchronisation.
+typedef struct SymbolTable {
+    unsigned int* slots;    // symbol ID, 0 = empty
+    unsigned int slotMask;
+    const char** names;     // indexed by ID
+    int* lengths;
+    unsigned int* hashes;
+    unsigned int count;     // IDs 1..count are in use
+    unsigned int capacity;
+    Arena strings;
+} SymbolTable;
+
+bool initSymbolTable(SymbolTable* table){
+    table->slotMask = 1023;
+    table->count = 0;
+    table->capacity = 512;
+    table->slots = calloc(table->slotMask + 1, sizeof(unsigned int));
+    table->names = malloc((table->capacity + 1) * sizeof(const char*));
+    table->lengths = malloc((table->capacity + 1) * sizeof(int));
+    table->hashes = malloc((table->capacity + 1) * sizeof(unsigned int));
+    initArena(&table->strings);
+    return table->slots && table->names && table->lengths && table->hashes;
+}
+
+void freeSymbolTable(SymbolTable* table){
+    free(table->slots);
+    free(table->names);
+    free(table->lengths);
+    free(table->hashes);
+    freeArena(&table->strings);
+    table->slots = NULL;
+    table->count = 0;
+}
+
+static bool growSymbolTable(SymbolTable* table){
+    unsigned int capacity = table->capacity * 2;
+    const char** names = realloc(table->names, (capacity + 1) * sizeof(const char*));
+    if(!names) return false;
+    table->names = names;
+    int* lengths = realloc(table->lengths, (capacity + 1) * sizeof(int));
+    if(!lengths) return false;
+    table->lengths = lengths;
+    unsigned int* hashes = realloc(table->hashes, (capacity + 1) * sizeof(unsigned int));
+    if(!hashes) return false;
+    table->hashes = hashes;
+
+    unsigned int slotMask = table->slotMask * 2 + 1;
+    unsigned int* slots = calloc(slotMask + 1, sizeof(unsigned int));
+    if(!slots) return false;
+    for(unsigned int id = 1; id <= table->count; id++){
+        unsigned int slot = table->hashes[id] & slotMask;
+        while(slots[slot]) slot = (slot + 1) & slotMask;
+        slots[slot] = id;
+    }
+    free(table->slots);
+    table->slots = slots;
+    table->slotMask = slotMask;
+    table->capacity = capacity;
+    return true;
+}
+
+// ID of name, adding it on first sight; 0 if out of memory
+unsigned int internSymbol(SymbolTable* table, const char* name, int length){
+    unsigned int hash = (unsigned int)hashBytes(name, length, 0);
+    unsigned int slot = hash & table->slotMask;
+    unsigned int id;
+    while((id = table->slots[slot]) != 0){
+        if(table->hashes[id] == hash && table->lengths[id] == length && memcmp(table->names[id], name, length) == 0){
+            return id;
+        }
+        slot = (slot + 1) & table->slotMask;
+    }
+
+    if(table->count == table->capacity){
+        if(!growSymbolTable(table)) return 0;
+        slot = hash & table->slotMask;
+        while(table->slots[slot]) slot = (slot + 1) & table->slotMask;
+    }
+    char* copy = arenaAlloc(&table->strings, length);
+    if(!copy) return 0;
+    memcpy(copy, name, length);
+
+    id = ++table->count;
+    table->names[id] = copy;
+    table->lengths[id] = length;
+    table->hashes[id] = hash;
+    table->slots[slot] = id;
+    return id;
+}
+
+// Interned name of id; not NUL-terminated, length is optional
+const char* symbolName(const SymbolTable* table, unsigned int id, int* length){
+    if(length) *length = table->lengths[id];
+    return table->names[id];
+}
+//Symbol Table
+
+//Vectorized Scanners
+// Fast paths for the long runs the automaton would otherwise walk one byte
+// at a time: whitespace, comment bodies and string bodies. Each scanner
+// returns the index of the first byte at or after `index` that the
+// automaton has to look at. countNewlines feeds the line index, and
+// validateUtf8 checks the input the lexer is about to cover.
+// SSE2 is the x86-64 baseline, AVX2 is picked at runtime, and other
+// targets use the scalar versions. LEXICAL_SCANNERS=scalar|sse2|avx2 in
+// the environment overrides the pick, to compare or rule out the vector
+// paths.
+typedef struct {
+    // first byte that is not ' ', '\t' or '\n'
+    int (*skipSpaces)(const char* input, int index, int length);
+    // first byte equal to any of the four needles (repeat one to use fewer)
+    int (*findAny)(const char* input, int index, int length, const char needles[4]);
+    // number of '\n' bytes in input[index, length)
+    int (*countNewlines)(const char* input, int index, int length);
+    // start of the first malformed UTF-8 sequence in input[index, length),
+    // length if there is none; index must not be inside a sequence
+    int (*validateUtf8)(const char* input, int index, int length);
+} Scanners;
+
+static int skipSpacesScalar(const char* input, int index, int length){
+    while(index < length && is_space(input[index])) index++;
+    return index;
+}
+
+static int findAnyScalar(const char* input, int index, int length, const char needles[4]){
+    for(; index < length; index++){
+        char c = input[index];
+        if(c == needles[0] || c == needles[1] || c == needles[2] || c == needles[3]) break;
+    }
+    return index;
+}
+
+static int countNewlinesScalar(const char* input, int index, int length){
+    int count = 0;
+    for(; index < length; index++) count += (input[index] == '\n');
+    return count;
+}
+
+// Size of the well-formed sequence starting at input[index] (a byte >= 0x80),
+// 0 if it is malformed or cut off at length. Overlong forms, surrogates and
+// code points past U+10FFFF are malformed.
+static int utf8SequenceSize(const unsigned char* input, int index, int length){
+    unsigned char lead = input[index];
+    unsigned char low = 0x80, high = 0xBF;  // range of the second byte
+    int size;
+    if(lead >= 0xC2 && lead <= 0xDF) size = 2;
+    else if(lead >= 0xE0 && lead <= 0xEF){
+        size = 3;
+        if(lead == 0xE0) low = 0xA0;
+        else if(lead == 0xED) high = 0x9F;
+    }
+    else if(lead >= 0xF0 && lead <= 0xF4){
+        size = 4;
+        if(lead == 0xF0) low = 0x90;
+        else if(lead == 0xF4) high = 0x8F;
+    }
+    else return 0;
+    if(size > length - index) return 0;
+    if(input[index + 1] < low || input[index + 1] > high) return 0;
+    for(int i = 2; i < size; i++){
+        if((input[index + i] & 0xC0) != 0x80) return 0;
+    }
+    return size;
 }
-//Helper Functions for getNextToken
+
+// Backs index up over at most three continuation bytes, not past start, so
+// it points at the first byte of the sequence it was inside
+static int utf8SequenceStart(const char* input, int start, int index){
+    for(int i = 0; i < 3 && index > start && ((unsigned char)input[index] & 0xC0) == 0x80; i++) index--;
+    return index;
+}
+
+static int validateUtf8Scalar(const char* input, int index, int length){
+    const unsigned char* bytes = (const unsigned char*)input;
+    while(index < length){
+        unsigned long long word;
+        if(index + 8 <= length && (memcpy(&word, bytes + index, 8), !(word & 0x8080808080808080ULL))){
+            index += 8;
+            continue;
+        }
+        if(bytes[index] < 0x80){
+            index++;
+            continue;
+        }
+        int size = utf8SequenceSize(bytes, index, length);
+        if(size == 0) return index;
+        index += size;
+    }
+    return length;
+}
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+
+static int skipSpacesSse2(const char* input, int index, int length){
+    const __m128i space = _mm_set1_epi8(' ');
+    const __m128i tab = _mm_set1_epi8('\t');
+    const __m128i newline = _mm_set1_epi8('\n');
+    while(index + 16 <= length){
+        __m128i block = _mm_loadu_si128((const __m128i*)(input + index));
+        __m128i ws = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, space), _mm_cmpeq_epi8(block, tab)),
+                                  _mm_cmpeq_epi8(block, newline));
+        unsigned int stop = ~(unsigned int)_mm_movemask_epi8(ws) & 0xFFFF;
+        if(stop) return index + __builtin_ctz(stop);
+        index += 16;
+    }
+    return skipSpacesScalar(input, index, length);
+}
+
+static int findAnySse2(const char* input, int index, int length, const char needles[4]){
+    const __m128i n0 = _mm_set1_epi8(needles[0]);
+    const __m128i n1 = _mm_set1_epi8(needles[1]);
+    const __m128i n2 = _mm_set1_epi8(needles[2]);
+    const __m128i n3 = _mm_set1_epi8(needles[3]);
+    while(index + 16 <= length){
+        __m128i block = _mm_loadu_si128((const __m128i*)(input + index));
+        __m128i hit = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(block, n0), _mm_cmpeq_epi8(block, n1)),
+                                   _mm_or_si128(_mm_cmpeq_epi8(block, n2), _mm_cmpeq_epi8(block, n3)));
+        unsigned int stop = (unsigned int)_mm_movemask_epi8(hit);
+        if(stop) return index + __builtin_ctz(stop);
+        index += 16;
+    }
+    return findAnyScalar(input, index, length, needles);
+}
+
+static int countNewlinesSse2(const char* input, int index, int length){
+    const __m128i newline = _mm_set1_epi8('\n');
+    int count = 0;
+    while(index + 16 <= length){
+        __m128i block = _mm_loadu_si128((const __m128i*)(input + index));
+        count += __builtin_popcount((unsigned int)_mm_movemask_epi8(_mm_cmpeq_epi8(block, newline)));
+        index += 16;
+    }
+    return count + countNewlinesScalar(input, index, length);
+}
+
+// ASCII goes 16 bytes a step; each multibyte sequence is checked on its own
+static int validateUtf8Sse2(const char* input, int index, int length){
+    const unsigned char* bytes = (const unsigned char*)input;
+    while(index + 16 <= length){
+        unsigned int high = (unsigned int)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)(input + index)));
+        if(!high){
+            index += 16;
+            continue;
+        }
+        index += __builtin_ctz(high);
+        int size = utf8SequenceSize(bytes, index, length);
+        if(size == 0) return index;
+        index += size;
+    }
+    return validateUtf8Scalar(input, index, length);
+}
+
+__attribute__((target("avx2")))
+static int skipSpacesAvx2(const char* input, int index, int length){
+    const __m256i space = _mm256_set1_epi8(' ');
+    const __m256i tab = _mm256_set1_epi8('\t');
+    const __m256i newline = _mm256_set1_epi8('\n');
+    while(index + 32 <= length){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(input + index));
+        __m256i ws = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, space), _mm256_cmpeq_epi8(block, tab)),
+                                     _mm256_cmpeq_epi8(block, newline));
+        unsigned int stop = ~(unsigned int)_mm256_movemask_epi8(ws);
+        if(stop) return index + __builtin_ctz(stop);
+        index += 32;
+    }
+    return skipSpacesSse2(input, index, length);
+}
+
+__attribute__((target("avx2")))
+static int findAnyAvx2(const char* input, int index, int length, const char needles[4]){
+    const __m256i n0 = _mm256_set1_epi8(needles[0]);
+    const __m256i n1 = _mm256_set1_epi8(needles[1]);
+    const __m256i n2 = _mm256_set1_epi8(needles[2]);
+    const __m256i n3 = _mm256_set1_epi8(needles[3]);
+    while(index + 32 <= length){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(input + index));
+        __m256i hit = _mm256_or_si256(_mm256_or_si256(_mm256_cmpeq_epi8(block, n0), _mm256_cmpeq_epi8(block, n1)),
+                                      _mm256_or_si256(_mm256_cmpeq_epi8(block, n2), _mm256_cmpeq_epi8(block, n3)));
+        unsigned int stop = (unsigned int)_mm256_movemask_epi8(hit);
+        if(stop) return index + __builtin_ctz(stop);
+        index += 32;
+    }
+    return findAnySse2(input, index, length, needles);
+}
+
+__attribute__((target("avx2")))
+static int countNewlinesAvx2(const char* input, int index, int length){
+    const __m256i newline = _mm256_set1_epi8('\n');
+    int count = 0;
+    while(index + 32 <= length){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(input + index));
+        count += __builtin_popcount((unsigned int)_mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline)));
+        index += 32;
+    }
+    return count + countNewlinesSse2(input, index, length);
+}
+
+// Keiser and Lemire's lookup validator: three 16-entry tables indexed by
+// the nibbles of each byte and the byte before it flag every malformed
+// pair at once, and the third and fourth bytes of long sequences are
+// checked against the leads two and three bytes back. An all-ASCII block
+// only has to confirm the previous block did not end mid-sequence. The
+// vector pass only says whether a block is bad; the scalar version then
+// finds the exact offset.
+#define UTF8_TOO_SHORT  0x01  // lead followed by ASCII or another lead
+#define UTF8_TOO_LONG   0x02  // ASCII followed by a continuation
+#define UTF8_OVERLONG_3 0x04  // E0 80..9F
+#define UTF8_TOO_LARGE  0x08  // F4 90..BF, F5 and up
+#define UTF8_SURROGATE  0x10  // ED A0..BF
+#define UTF8_OVERLONG_2 0x20  // C0, C1
+#define UTF8_TOO_LARGE_1000 0x40  // F5 and up followed by 80..8F
+#define UTF8_OVERLONG_4 0x40  // F0 80..8F
+#define UTF8_TWO_CONTS  0x80  // continuation after continuation
+#define UTF8_CARRY (UTF8_TOO_SHORT | UTF8_TOO_LONG | UTF8_TWO_CONTS)
+
+// The bytes n places back, taking the head of block from previous
+#define UTF8_PREVIOUS(block, previous, n) \
+    _mm256_alignr_epi8((block), _mm256_permute2x128_si256((previous), (block), 0x21), 16 - (n))
+#define UTF8_TABLE(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+__attribute__((target("avx2")))
+static __m256i utf8BlockErrors(__m256i block, __m256i previous){
+    const __m256i byte1HighTable = UTF8_TABLE(
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG, UTF8_TOO_LONG,
+        (char)UTF8_TWO_CONTS, (char)UTF8_TWO_CONTS, (char)UTF8_TWO_CONTS, (char)UTF8_TWO_CONTS,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_2,
+        UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT | UTF8_OVERLONG_3 | UTF8_SURROGATE,
+        UTF8_TOO_SHORT | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4);
+    const __m256i byte1LowTable = UTF8_TABLE(
+        (char)(UTF8_CARRY | UTF8_OVERLONG_3 | UTF8_OVERLONG_2 | UTF8_OVERLONG_4),
+        (char)(UTF8_CARRY | UTF8_OVERLONG_2),
+        (char)UTF8_CARRY,
+        (char)UTF8_CARRY,
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000 | UTF8_SURROGATE),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000),
+        (char)(UTF8_CARRY | UTF8_TOO_LARGE | UTF8_TOO_LARGE_1000));
+    const __m256i byte2HighTable = UTF8_TABLE(
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT,
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE_1000 | UTF8_OVERLONG_4),
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_OVERLONG_3 | UTF8_TOO_LARGE),
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+        (char)(UTF8_TOO_LONG | UTF8_OVERLONG_2 | UTF8_TWO_CONTS | UTF8_SURROGATE | UTF8_TOO_LARGE),
+        UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT, UTF8_TOO_SHORT);
+    const __m256i nibble = _mm256_set1_epi8(0x0F);
+
+    __m256i prev1 = UTF8_PREVIOUS(block, previous, 1);
+    __m256i byte1High = _mm256_shuffle_epi8(byte1HighTable, _mm256_and_si256(_mm256_srli_epi16(prev1, 4), nibble));
+    __m256i byte1Low = _mm256_shuffle_epi8(byte1LowTable, _mm256_and_si256(prev1, nibble));
+    __m256i byte2High = _mm256_shuffle_epi8(byte2HighTable, _mm256_and_si256(_mm256_srli_epi16(block, 4), nibble));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte1High, byte1Low), byte2High);
+
+    // a continuation is required two bytes after E0..FF and three after F0..FF
+    __m256i third = _mm256_subs_epu8(UTF8_PREVIOUS(block, previous, 2), _mm256_set1_epi8(0xE0 - 0x80));
+    __m256i fourth = _mm256_subs_epu8(UTF8_PREVIOUS(block, previous, 3), _mm256_set1_epi8(0xF0 - 0x80));
+    __m256i required = _mm256_and_si256(_mm256_or_si256(third, fourth), _mm256_set1_epi8((char)0x80));
+    return _mm256_xor_si256(required, special);
+}
+
+__attribute__((target("avx2")))
+static int validateUtf8Avx2(const char* input, int index, int length){
+    // a lead in the last three bytes needs bytes from the next block
+    const __m256i tailLimit = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        (char)(0xF0 - 1), (char)(0xE0 - 1), (char)(0xC0 - 1));
+    int start = index;
+    __m256i previous = _mm256_setzero_si256();
+    __m256i incomplete = _mm256_setzero_si256();
+    while(index + 32 <= length){
+        __m256i block = _mm256_loadu_si256((const __m256i*)(input + index));
+        __m256i errors = incomplete;
+        incomplete = _mm256_setzero_si256();
+        if(_mm256_movemask_epi8(block)){
+            errors = utf8BlockErrors(block, previous);
+            incomplete = _mm256_subs_epu8(block, tailLimit);
+        }
+        if(!_mm256_testz_si256(errors, errors)) break;
+        previous = block;
+        index += 32;
+    }
+    // the tail or the bad block, from the first sequence that can reach it
+    int from = index - 3 > start ? index - 3 : start;
+    return validateUtf8Scalar(input, utf8SequenceStart(input, start, from), length);
+}
+#endif
+
+typedef struct {
+    const char* name;
+    Scanners functions;
+} ScannerSet;
+
+// Slowest first
+static const ScannerSet scannerSets[] = {
+    {"scalar", { skipSpacesScalar, findAnyScalar, countNewlinesScalar, validateUtf8Scalar }},
+#if defined(__x86_64__)
+    {"sse2", { skipSpacesSse2, findAnySse2, countNewlinesSse2, validateUtf8Sse2 }},
+    {"avx2", { skipSpacesAvx2, findAnyAvx2, countNewlinesAvx2, validateUtf8Avx2 }},
+#endif
+};
+#define SCANNER_SET_COUNT (int)(sizeof(scannerSets) / sizeof(scannerSets[0]))
+
+static Scanners scanners = { skipSpacesScalar, findAnyScalar, countNewlinesScalar, validateUtf8Scalar };
+static const char* scannersInUse = "scalar";
+static pthread_once_t scannersOnce = PTHREAD_ONCE_INIT;
+
+static bool scannerSetSupported(const ScannerSet* set){
+#if defined(__x86_64__)
+    __builtin_cpu_init();
+    if(strcmp(set->name, "avx2") == 0) return __builtin_cpu_supports("avx2");
+#endif
+    (void)set;
+    return true;
+}
+
+static bool applyScannerSet(const char* name){
+    for(int i = 0; i < SCANNER_SET_COUNT; i++){
+        if(strcmp(scannerSets[i].name, name) != 0) continue;
+        if(!scannerSetSupported(&scannerSets[i])) return false;
+        scanners = scannerSets[i].functions;
+        scannersInUse = scannerSets[i].name;
+        return true;
+    }
+    return false;
+}
+
+static void selectScanners(){
+    for(int i = SCANNER_SET_COUNT - 1; i >= 0; i--){
+        if(applyScannerSet(scannerSets[i].name)) break;
+    }
+    const char* forced = getenv("LEXICAL_SCANNERS");
+    if(forced && !applyScannerSet(forced)){
+        fprintf(stderr, "lexical: warning: LEXICAL_SCANNERS=%s unavailable, using %s\n", forced, scannersInUse);
+    }
+}
+
+// Switches every lexer to the named scanner set; false if it is unknown
+// or the CPU lacks it. Only safe while no lexer is running.
+bool useScanners(const char* name){
+    pthread_once(&scannersOnce, selectScanners);
+    return applyScannerSet(name);
+}
+
+// Needle sets for the automaton states that use findAny. '\0' is always a
+// needle because the automaton treats it as end of input.
+static const char lineCommentStops[4] = { '\n', '\0', '\n', '\n' };
+static const char blockCommentStops[4] = { '/', '\0', '/', '/' };
+static const char stringStops[4] = { '\"', '\\', '\n', '\0' };
+//Vectorized Scanners
 
 //Automaton States
 typedef enum{
@@ -149,130 +753,571 @@ typedef enum{
     STATE_IN_SINGLE_LINE_COMMENT,
     STATE_IN_BLOCK_COMMENT,
     STATE_IN_BLOCK_COMMENT_TILDE,
-    //special states for DIV operator
-    STATE_IN_D_DIV,
-    STATE_IN_I,
-    STATE_IN_V,
-    //special states for or operator
-    STATE_IN_O,
-    STATE_IN_R,
-    //special states for and operator
-    STATE_IN_A,
-    STATE_IN_N,
-    STATE_IN_D_AND,
     //special states for = and == 
     STATE_IN_EQUAL,
+    STATE_IN_DECIMAL,   // digits after the '.' of a number
+    STATE_IN_UTF8,      // continuation bytes of a non-ASCII character
     STATE_DONE,
 }AutomatonState;
 //Automaton States
 
+//Instrumentation
+// Build with -DLEXER_STATS to count automaton state visits, tokens by type
+// and per-file lexing time in ticks (TSC cycles on x86-64, nanoseconds
+// elsewhere). Hooks bump a thread-local block with no atomics; a thread's
+// counts reach the process totals when it calls lexerStatsFlush(), which
+// parallel workers do before exiting and lexerStatsSnapshot() does for the
+// caller. Without the flag every hook compiles to nothing.
+#ifdef LEXER_STATS
+#define AUTOMATON_STATE_COUNT (STATE_DONE + 1)
+
+const char* automatonStateNames[AUTOMATON_STATE_COUNT] = {
+    "STATE_START", "STATE_IN_IDENTIFIER", "STATE_IN_NUMBER", "STATE_IN_CHAR",
+    "STATE_IN_CHAR_EXPECT_CLOSE", "STATE_IN_CHAR_ESCAPE", "STATE_IN_STRING",
+    "STATE_IN_STRING_ESCAPE", "STATE_IN_TILDE", "STATE_IN_SINGLE_LINE_COMMENT",
+    "STATE_IN_BLOCK_COMMENT", "STATE_IN_BLOCK_COMMENT_TILDE", "STATE_IN_EQUAL",
+    "STATE_IN_DECIMAL", "STATE_IN_UTF8", "STATE_DONE"
+};
+
+typedef struct {
+    unsigned long long transitions[AUTOMATON_STATE_COUNT];
+    unsigned long long tokens[TOKEN_TYPE_COUNT];
+    unsigned long long files;
+    unsigned long long fileBytes;
+    unsigned long long fileTicks;
+    unsigned long long maxFileTicks;
+} LexerStats;
+
+static _Thread_local LexerStats threadStats;
+static LexerStats totalStats;
+static pthread_mutex_t totalStatsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static inline unsigned long long lexerStatsTicks(){
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+#endif
+}
+
+static void lexerStatsEndFile(unsigned long long start, int bytes){
+    unsigned long long ticks = lexerStatsTicks() - start;
+    threadStats.files++;
+    threadStats.fileBytes += bytes;
+    threadStats.fileTicks += ticks;
+    if(ticks > threadStats.maxFileTicks) threadStats.maxFileTicks = ticks;
+}
+
+// Folds the calling thread's counters into the process totals
+void lexerStatsFlush(){
+    pthread_mutex_lock(&totalStatsLock);
+    for(int i = 0; i < AUTOMATON_STATE_COUNT; i++) totalStats.transitions[i] += threadStats.transitions[i];
+    for(int i = 0; i < TOKEN_TYPE_COUNT; i++) totalStats.tokens[i] += threadStats.tokens[i];
+    totalStats.files += threadStats.files;
+    totalStats.fileBytes += threadStats.fileBytes;
+    totalStats.fileTicks += threadStats.fileTicks;
+    if(threadStats.maxFileTicks > totalStats.maxFileTicks) totalStats.maxFileTicks = threadStats.maxFileTicks;
+    pthread_mutex_unlock(&totalStatsLock);
+    memset(&threadStats, 0, sizeof(threadStats));
+}
+
+void lexerStatsSnapshot(LexerStats* snapshot){
+    lexerStatsFlush();
+    pthread_mutex_lock(&totalStatsLock);
+    *snapshot = totalStats;
+    pthread_mutex_unlock(&totalStatsLock);
+}
+
+// Snapshot in Prometheus text format, zero counters left out
+void writeLexerStats(FILE* out){
+    LexerStats stats;
+    lexerStatsSnapshot(&stats);
+    fprintf(out, "# TYPE lexer_state_transitions_total counter\n");
+    for(int i = 0; i < AUTOMATON_STATE_COUNT; i++){
+        if(stats.transitions[i]) fprintf(out, "lexer_state_transitions_total{state=\"%s\"} %llu\n", automatonStateNames[i], stats.transitions[i]);
+    }
+    fprintf(out, "# TYPE lexer_tokens_total counter\n");
+    for(int i = 0; i < TOKEN_TYPE_COUNT; i++){
+        if(stats.tokens[i]) fprintf(out, "lexer_tokens_total{type=\"%s\"} %llu\n", tokenTypeNames[i], stats.tokens[i]);
+    }
+    fprintf(out, "# TYPE lexer_files_total counter\nlexer_files_total %llu\n", stats.files);
+    fprintf(out, "# TYPE lexer_file_bytes_total counter\nlexer_file_bytes_total %llu\n", stats.fileBytes);
+    fprintf(out, "# TYPE lexer_file_ticks_total counter\nlexer_file_ticks_total %llu\n", stats.fileTicks);
+    fprintf(out, "# TYPE lexer_file_ticks_max gauge\nlexer_file_ticks_max %llu\n", stats.maxFileTicks);
+}
+
+#define LEXER_STATS_STATE(state) (threadStats.transitions[(state)]++)
+#define LEXER_STATS_TOKEN(type) (threadStats.tokens[(type)]++)
+#define LEXER_STATS_FILE_BEGIN(start) unsigned long long start = lexerStatsTicks()
+#define LEXER_STATS_FILE_END(start, bytes) lexerStatsEndFile(start, bytes)
+#define LEXER_STATS_FLUSH() lexerStatsFlush()
+#else
+#define LEXER_STATS_STATE(state) ((void)0)
+#define LEXER_STATS_TOKEN(type) ((void)0)
+#define LEXER_STATS_FILE_BEGIN(start) ((void)0)
+#define LEXER_STATS_FILE_END(start, bytes) ((void)0)
+#define LEXER_STATS_FLUSH() ((void)0)
+#endif
+//Instrumentation
+
+//Helper Functions for getNextToken
+// Lexer Context: all cursor state lives here so independent lexers can run
+// on different threads. The input does not need a NUL terminator.
+// The input is UTF-8: a token holding a malformed sequence comes back as
+// Diag_Invalid_Utf8. Outside strings, comments and (with
+// unicodeIdentifiers) identifiers, each non-ASCII character is one
+// Token_Unknown.
+typedef struct {
+    const char* inputStream;
+    int streamLength;
+    int streamIndex;
+    int utf8Checked;          // UTF-8 validation has reached this offset
+    bool unicodeIdentifiers;  // non-ASCII characters may start and continue identifiers
+    SymbolTable* symbols;     // interns identifiers when set
+    Arena literals;           // decoded escape-bearing literals, see decodeLiteral
+} Lexer;
+
+void initLexer(Lexer* lexer, const char* input, int length){
+    pthread_once(&scannersOnce, selectScanners);
+    initKeywordSlots();
+    initDfaTables();
+    lexer->inputStream = input;
+    lexer->streamLength = input ? length : 0;
+    lexer->streamIndex = 0;
+    lexer->utf8Checked = 0;
+    lexer->unicodeIdentifiers = false;
+    lexer->symbols = NULL;
+    initArena(&lexer->literals);
+}
+
+// Only needed once decodeLiteral has been used on the lexer
+void freeLexer(Lexer* lexer){
+    freeArena(&lexer->literals);
+}
+
+char peekChar(Lexer* lexer){
+    if (lexer->streamIndex >= lexer->streamLength) return '\0';
+    return lexer->inputStream[lexer->streamIndex];
+}
+
+char getChar(Lexer* lexer) {
+    if (lexer->streamIndex >= lexer->streamLength) return '\0';
+    char c = lexer->inputStream[lexer->streamIndex];
+    if (c == '\0') return '\0';
+    lexer->streamIndex++;
+    return c;
+}
+Token createToken(Token_Type type, int offset, int length) {
+    LEXER_STATS_TOKEN(type);
+    Token token;
+    token.type = type;
+    token.diagnostic = Diag_None;
+    token.flags = 0;
+    token.offset = offset;
+    token.length = length;
+    token.symbol = 0;
+    token.value.integer = 0;
+    return token;
+}
+Token createErrorToken(Lexer_Diagnostic diagnostic, int offset, int length) {
+    Token token = createToken(Token_Unknown, offset, length);
+    token.diagnostic = diagnostic;
+    return token;
+}
+
+static bool isIdentifierChar(char c, bool unicode){
+    return is_alphanumeric(c) || c == '_' || (unicode && (unsigned char)c >= 0x80);
+}
+
+// UTF-8 validation runs ahead of the lexer a block at a time, so ASCII
+// input costs one compare per token plus a vector pass at memory speed.
+// Blocks end on a sequence boundary unless the input ends first.
+#define UTF8_BLOCK (16 * 1024)
+
+// Validates up to the end of token, which the lexer just scanned starting
+// from offset `from`. A token holding a malformed sequence is replaced by a
+// Diag_Invalid_Utf8 error over the same span.
+static Token checkTokenUtf8(Lexer* lexer, Token token, int from){
+    int end = lexer->streamIndex;
+    if(lexer->utf8Checked < from) lexer->utf8Checked = from;
+    while(lexer->utf8Checked < end){
+        int checked = lexer->utf8Checked;
+        int to = lexer->streamLength;
+        if(to - checked > UTF8_BLOCK) to = utf8SequenceStart(lexer->inputStream, checked, checked + UTF8_BLOCK);
+        int bad = scanners.validateUtf8(lexer->inputStream, checked, to);
+        if(bad == to){
+            lexer->utf8Checked = to;
+            continue;
+        }
+        if(bad >= end){
+            // a later token holds it; resume there
+            lexer->utf8Checked = bad;
+            break;
+        }
+        // whitespace is ASCII, so the bad byte is inside this token
+        lexer->utf8Checked = end;
+        int start = tokenSpanStart(token);
+        return createErrorToken(Diag_Invalid_Utf8, start, end - start);
+    }
+    return token;
+}
+//Helper Functions for getNextToken
+
+//Literal Decoding
+// String and char tokens keep their raw span. Most literals have no escapes
+// and are returned in place; the rest are decoded into the arena on demand,
+// so there is no length cap. The result is not NUL-terminated.
+const char* literalValue(Arena* arena, const char* source, Token token, int* length){
+    const char* raw = source + token.offset;
+    if(!(token.flags & TOKEN_HAS_ESCAPES)){
+        *length = token.length;
+        return raw;
+    }
+
+    // decoding only ever shrinks the body
+    char* decoded = arenaAlloc(arena, token.length);
+    if(!decoded) return NULL;
+    const char* end = raw + token.length;
+    char* out = decoded;
+    const char* escape;
+    while((escape = memchr(raw, '\\', end - raw)) && escape + 1 < end){
+        memcpy(out, raw, escape - raw);
+        out += escape - raw;
+        char c = escape[1];
+        if(c == 'n') c = '\n';
+        else if(c == 't') c = '\t';
+        *out++ = c;
+        raw = escape + 2;
+    }
+    memcpy(out, raw, end - raw);
+    out += end - raw;
+    *length = (int)(out - decoded);
+    return decoded;
+}
+
+const char* decodeLiteral(Lexer* lexer, Token token, int* length){
+    return literalValue(&lexer->literals, lexer->inputStream, token, length);
+}
+//Literal Decoding
+
+//Numeric Literals
+// Number tokens carry their value: integers as value.integer, decimals
+// (digits '.' digits, the fraction may be empty) as value.decimal with
+// TOKEN_DECIMAL set. Digits are checked and converted eight at a time with
+// SWAR where the input allows an 8-byte load. A decimal whose digits fit
+// in 2^53 with at most 22 fraction digits is one exactly rounded division
+// (Clinger's fast path); anything longer goes through strtod. A value
+// that does not fit comes back as Token_Unknown with Diag_Number_Overflow.
+static const unsigned long long powersOfTen[] = {
+    1ULL, 10ULL, 100ULL, 1000ULL, 10000ULL, 100000ULL, 1000000ULL, 10000000ULL, 100000000ULL
+};
+static const double exactPowersOfTen[] = {
+    1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+};
+#define EXACT_POWER_MAX 22
+#define EXACT_MANTISSA_MAX (1ULL << 53)
+
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define NUMBER_SWAR 1
+
+// Leading digit bytes of an 8-byte load, first byte lowest
+static inline int countLeadingDigits(unsigned long long chunk){
+    // a byte is a digit iff both its high nibble and that of byte + 6 are 3;
+    // a carry out of a non-digit byte only disturbs bytes after it
+    unsigned long long nibbles = (chunk & 0xF0F0F0F0F0F0F0F0ULL) |
+                                 (((chunk + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4);
+    unsigned long long stops = nibbles ^ 0x3333333333333333ULL;
+    return stops ? __builtin_ctzll(stops) >> 3 : 8;
+}
+
+// Eight digit values (0-9 per byte, first byte lowest) as one number
+static inline unsigned long long combineEightDigits(unsigned long long digits){
+    digits = digits * 10 + (digits >> 8);
+    return (((digits & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+            (((digits >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+}
+#endif
+
+// Consumes the digits at input[index], appending them to *value; sets
+// *overflow once *value no longer fits
+static int scanDigits(const char* input, int index, int length, unsigned long long* value, bool* overflow){
+    unsigned long long result = *value;
+#ifdef NUMBER_SWAR
+    while(index + 8 <= length){
+        unsigned long long chunk;
+        memcpy(&chunk, input + index, 8);
+        int digits = countLeadingDigits(chunk);
+        if(digits > 0){
+            // subtract first so borrows from the non-digit tail are shifted out
+            unsigned long long values = (chunk - 0x3030303030303030ULL) << (8 * (8 - digits));
+            if(__builtin_mul_overflow(result, powersOfTen[digits], &result) ||
+               __builtin_add_overflow(result, combineEightDigits(values), &result)){
+                *overflow = true;
+            }
+        }
+        index += digits;
+        if(digits < 8){
+            *value = result;
+            return index;
+        }
+    }
+#endif
+    while(index < length && is_digit(input[index])){
+        if(__builtin_mul_overflow(result, 10ULL, &result) ||
+           __builtin_add_overflow(result, (unsigned long long)(input[index] - '0'), &result)){
+            *overflow = true;
+        }
+        index++;
+    }
+    *value = result;
+    return index;
+}
+
+static double slowDecimal(const char* text, int length, bool* overflow){
+    char small[64];
+    char* copy = length < (int)sizeof(small) ? small : malloc(length + 1);
+    if(!copy){
+        *overflow = true;
+        return 0;
+    }
+    memcpy(copy, text, length);
+    copy[length] = '\0';
+    double value = strtod(copy, NULL);
+    if(copy != small) free(copy);
+    if(value > DBL_MAX) *overflow = true;
+    return value;
+}
+
+// Scans and converts the number starting at input[start] (a digit); *end
+// gets the index just past it
+Token lexNumber(const char* input, int start, int length, int* end){
+    unsigned long long mantissa = 0;
+    bool overflow = false;
+    int index = scanDigits(input, start, length, &mantissa, &overflow);
+    if(index >= length || input[index] != '.'){
+        *end = index;
+        if(overflow || mantissa > (unsigned long long)LLONG_MAX){
+            return createErrorToken(Diag_Number_Overflow, start, index - start);
+        }
+        Token token = createToken(Token_Number, start, index - start);
+        token.value.integer = (long long)mantissa;
+        return token;
+    }
+
+    int fractionStart = index + 1;
+    index = scanDigits(input, fractionStart, length, &mantissa, &overflow);
+    *end = index;
+    int fractionDigits = index - fractionStart;
+    double value;
+    if(!overflow && mantissa <= EXACT_MANTISSA_MAX && fractionDigits <= EXACT_POWER_MAX){
+        value = (double)mantissa / exactPowersOfTen[fractionDigits];
+    }
+    else{
+        overflow = false;
+        value = slowDecimal(input + start, index - start, &overflow);
+    }
+    if(overflow) return createErrorToken(Diag_Number_Overflow, start, index - start);
+    Token token = createToken(Token_Number, start, index - start);
+    token.flags = TOKEN_DECIMAL;
+    token.value.decimal = value;
+    return token;
+}
+//Numeric Literals
+
+//Keyword Classification
+// Perfect hash over keywords[]: keywordHash() is collision-free for the
+// table, so classifying an identifier costs one slot lookup and at most
+// one string compare. The multipliers, the table size and keywordSlots
+// (keyword index + 1, 0 = no keyword) are searched for from keywords[]
+// when the first lexer is set up, so editing the table needs no
+// regeneration step. A table with no perfect hash in the search range
+// stops the program instead of misclassifying.
+#define KEYWORD_MAX_SLOTS 256
+
+static unsigned char keywordSlots[KEYWORD_MAX_SLOTS];
+static unsigned int keywordSlotMask;
+static unsigned int keywordLengthFactor;
+static unsigned int keywordFirstFactor;
+static int keywordMinLength;
+static int keywordMaxLength;
+static pthread_once_t keywordSlotsOnce = PTHREAD_ONCE_INIT;
+
+static inline unsigned int keywordHash(const char* word, int length){
+    return (keywordLengthFactor * length + keywordFirstFactor * (unsigned char)word[0] +
+            (unsigned char)word[length - 1]) & keywordSlotMask;
+}
+
+static void buildKeywordSlots(){
+    keywordMinLength = INT_MAX;
+    keywordMaxLength = 0;
+    for(int i = 0; i < KEYWORD_COUNT; i++){
+        int length = strlen(keywords[i].word);
+        if(length < keywordMinLength) keywordMinLength = length;
+        if(length > keywordMaxLength) keywordMaxLength = length;
+    }
+    // smallest table first, so the slots stay in one or two cache lines
+    for(unsigned int size = 32; size <= KEYWORD_MAX_SLOTS; size *= 2){
+        for(unsigned int a = 0; a < 16; a++){
+            for(unsigned int b = 1; b < 16; b++){
+                keywordSlotMask = size - 1;
+                keywordLengthFactor = a;
+                keywordFirstFactor = b;
+                memset(keywordSlots, 0, sizeof(keywordSlots));
+                bool perfect = true;
+                for(int i = 0; i < KEYWORD_COUNT && perfect; i++){
+                    unsigned int slot = keywordHash(keywords[i].word, strlen(keywords[i].word));
+                    perfect = keywordSlots[slot] == 0;
+                    keywordSlots[slot] = i + 1;
+                }
+                if(perfect) return;
+            }
+        }
+    }
+    fprintf(stderr, "lexical: no perfect hash for keywords[]; widen the search in buildKeywordSlots()\n");
+    abort();
+}
+
+// initLexer() calls this; getlexemeType() needs it done first
+void initKeywordSlots(){
+    pthread_once(&keywordSlotsOnce, buildKeywordSlots);
+}
+
+Token_Type getlexemeType(const char* lexeme, int length){
+    if(length < keywordMinLength || length > keywordMaxLength) return Token_Identifier;
+    int slot = keywordSlots[keywordHash(lexeme, length)];
+    if(slot == 0) return Token_Identifier;
+    const char* word = keywords[slot - 1].word;
+    // strncmp stops at a shorter word's NUL, so word[length] is only read when in bounds
+    if(strncmp(word, lexeme, length) != 0 || word[length] != '\0') return Token_Identifier;
+    return keywords[slot - 1].type;
+}
+//Keyword Classification
+
 //getNextToken Function
-Token getNextToken(){
+// Identifier or keyword ending at streamIndex; keywords (including DIV, or
+// and and) are classified after the scan
+static inline Token finishIdentifier(Lexer* lexer, int lexemeStart){
+    Token_Type finalType = getlexemeType(lexer->inputStream + lexemeStart, lexer->streamIndex - lexemeStart);
+    Token token = createToken(finalType, lexemeStart, lexer->streamIndex - lexemeStart);
+    if(finalType == Token_Identifier && lexer->symbols){
+        token.symbol = internSymbol(lexer->symbols, lexer->inputStream + lexemeStart, token.length);
+    }
+    return token;
+}
+
+// The rest of the number starting at lexemeStart, fraction included, is
+// scanned and converted in one go
+static inline Token finishNumber(Lexer* lexer, int lexemeStart){
+    int end;
+    Token token = lexNumber(lexer->inputStream, lexemeStart, lexer->streamLength, &end);
+    lexer->streamIndex = end;
+    return token;
+}
+
+static Token scanTokenSwitch(Lexer* lexer){
     AutomatonState currentState = STATE_START;
-    char lexemeBuffer[MAX_LEXEME_LENGTH];
-    int lexemeIndex = 0;
+    int lexemeStart = lexer->streamIndex;
+    bool hasEscapes = false;
     char currentChar;
 
     while(currentState != STATE_DONE){
-        currentChar = peekChar();
+        currentChar = peekChar(lexer);
+        LEXER_STATS_STATE(currentState);
 
         switch(currentState){
             case STATE_START:
-                if(is_space(currentChar)){
-                    getChar();
+                lexemeStart = lexer->streamIndex;
+                if(currentChar == '\0'){
+                    currentState = STATE_DONE;
+                    return createToken(Token_CodeEnd, lexer->streamIndex, 0);
+                }
+                else if(is_space(currentChar)){
+                    getChar(lexer);
+                    // single separators are the common case, only runs go wide
+                    if(is_space(peekChar(lexer))){
+                        lexer->streamIndex = scanners.skipSpaces(lexer->inputStream, lexer->streamIndex, lexer->streamLength);
+                    }
                 }
                 else if(strchr("()[]{},", currentChar)){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Delimeter, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Delimeter, lexemeStart, 1);
                 }
                 else if(strchr("+-*%/^", currentChar)){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Arithmetic_Operator, lexemeBuffer, lexemeIndex);
-                }
-                else if(currentChar == 'D'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_D_DIV;
-                }
-                else if(currentChar == 'o'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_O;
-                }
-                else if(currentChar == 'a'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_A;
+                    return createToken(Token_Arithmetic_Operator, lexemeStart, 1);
                 }
                 else if(is_alpha(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_IDENTIFIER;
                 }
                 else if(is_digit(currentChar)){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_NUMBER;
                 }
                 else if(currentChar == '\''){
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_CHAR;
                 }
                 else if(currentChar == '\"'){
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_STRING;
                 }
                 else if(currentChar == '~' ){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_TILDE;
                 }
                 else if(currentChar == '='){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_EQUAL;
                 }
+                else if((unsigned char)currentChar >= 0x80){
+                    getChar(lexer);
+                    currentState = lexer->unicodeIdentifiers ? STATE_IN_IDENTIFIER : STATE_IN_UTF8;
+                }
                 else{
                     //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Unknown, lexemeStart, 1);
                 }
                 break;
             
             case STATE_IN_IDENTIFIER:
-                if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                if(isIdentifierChar(currentChar, lexer->unicodeIdentifiers)){
+                    getChar(lexer);
                 }
                 else{
                     currentState = STATE_DONE;
-                    // Change "Token_Identifier" with lookup table function call
-                    Token_Type finalType = Token_Identifier;
-                    return createToken(finalType, lexemeBuffer, lexemeIndex);
+                    return finishIdentifier(lexer, lexemeStart);
                 }
                 break;
             
             case STATE_IN_NUMBER:
-                if(is_digit(currentChar)) {
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                }
-                else{
-                    currentState = STATE_DONE;
-                    return createToken(Token_Number, lexemeBuffer, lexemeIndex);
-                }
-                break;
+            case STATE_IN_DECIMAL:
+                currentState = STATE_DONE;
+                return finishNumber(lexer, lexemeStart);
             
             case STATE_IN_CHAR:
                 if(currentChar == '\\'){
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_CHAR_ESCAPE;
                 }
                 else if(currentChar =='\n'|| currentChar == '\0'){ //UNCLOSED CHAR ERROR
                     currentState = STATE_DONE; 
-                    return createToken(Token_Unknown, "Unclosed Char", 13);
+                    return createErrorToken(Diag_Unclosed_Char, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else if(currentChar == '\''){
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, "Empty char literal", 18);
+                    return createErrorToken(Diag_Empty_Char, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else{
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_CHAR_EXPECT_CLOSE;
                 }
 
@@ -280,105 +1325,82 @@ Token getNextToken(){
 
             case STATE_IN_CHAR_EXPECT_CLOSE:
                 if(currentChar == '\'') {
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Character, lexemeBuffer, lexemeIndex);
+                    // lexeme is the literal body, without the quotes
+                    Token token = createToken(Token_Character, lexemeStart + 1, lexer->streamIndex - lexemeStart - 2);
+                    if(hasEscapes) token.flags = TOKEN_HAS_ESCAPES;
+                    return token;
+                }
+                else if(((unsigned char)currentChar & 0xC0) == 0x80){
+                    // rest of a multibyte character
+                    getChar(lexer);
                 }
                 else{
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, "Multi-character literal", 22);
+                    return createErrorToken(Diag_Multi_Char, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 break;
 
             case STATE_IN_CHAR_ESCAPE:
+                // escapes stay raw in the source span
                 switch (currentChar) {
                     case 'n': 
-                        lexemeBuffer[lexemeIndex++] = '\n'; 
-                        getChar(); 
-                        break;
                     case 't': 
-                        lexemeBuffer[lexemeIndex++] = '\t'; 
-                        getChar(); 
-                        break;
                     case '\'': 
-                        lexemeBuffer[lexemeIndex++] = '\''; 
-                        getChar(); 
-                        break;
                     case '\\': 
-                        lexemeBuffer[lexemeIndex++] = '\\'; 
-                        getChar(); 
+                        getChar(lexer); 
+                        hasEscapes = true;
                         break;
                     default:
                         currentState = STATE_DONE;
-                        return createToken(Token_Unknown, "Invalid escape sequence", 23);
+                        return createErrorToken(Diag_Invalid_Escape, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 currentState = STATE_IN_CHAR_EXPECT_CLOSE; 
                 break;
 
             case STATE_IN_STRING:
                 if(currentChar == '\\'){
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_STRING_ESCAPE;
                 }
                 else if(currentChar == '\"'){
-                    getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_String, lexemeBuffer, lexemeIndex);
+                    // lexeme is the literal body, without the quotes
+                    Token token = createToken(Token_String, lexemeStart + 1, lexer->streamIndex - lexemeStart - 2);
+                    if(hasEscapes) token.flags = TOKEN_HAS_ESCAPES;
+                    return token;
                 }
                 else if(currentChar =='\n'|| currentChar == '\0'){ //UNCLOSED STRING ERROR
                     currentState = STATE_DONE; 
-                    return createToken(Token_Unknown, "Unclosed String", 15);
+                    return createErrorToken(Diag_Unclosed_String, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else{
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    lexer->streamIndex = scanners.findAny(lexer->inputStream, lexer->streamIndex, lexer->streamLength, stringStops);
                 }
                 break;
             
             case STATE_IN_STRING_ESCAPE:
+                // escapes stay raw in the source span
                 switch (currentChar) {
                     case 'n':
-                        lexemeBuffer[lexemeIndex++] = '\n'; 
-                        getChar(); 
-                        break;
                     case 't':
-                        lexemeBuffer[lexemeIndex++] = '\t'; 
-                        getChar(); // 
-                        break;
                     case '\"':
-                        lexemeBuffer[lexemeIndex++] = '\"'; 
-                        getChar(); // Consume the '"'
-                        break;
                     case '\\':
-                        lexemeBuffer[lexemeIndex++] = '\\'; 
-                        getChar(); //
+                        getChar(lexer);
+                        hasEscapes = true;
                         break;
                     default:
                         currentState = STATE_DONE;
-                        return createToken(Token_Unknown, "Invalid escape sequence", 23);
+                        return createErrorToken(Diag_Invalid_Escape, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 currentState = STATE_IN_STRING;
                 break;  
 
-            case STATE_IN_D_DIV:
-                if(currentChar == 'I'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_I;
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
-                }
-                else{
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
-                }
-                break;
-            
             case STATE_IN_TILDE:
                 if(currentChar == '/'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_BLOCK_COMMENT;
                 }
                 else{
@@ -389,289 +1411,4586 @@ Token getNextToken(){
             case STATE_IN_SINGLE_LINE_COMMENT:
                 if (currentChar == '\n' || currentChar == '\0') {
                     currentState = STATE_DONE;
-                    return createToken(Token_Single_Line_Comment, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Single_Line_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else {
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    lexer->streamIndex = scanners.findAny(lexer->inputStream, lexer->streamIndex, lexer->streamLength, lineCommentStops);
                 }
                 break;
 
             case STATE_IN_BLOCK_COMMENT:
                 if(currentChar == '/') {
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_IN_BLOCK_COMMENT_TILDE;
                 }
                 else if (currentChar == '\0') {
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, "Unclosed block comment", 22);
+                    return createErrorToken(Diag_Unclosed_Block_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else {
-                    lexemeBuffer[lexemeIndex++] = getChar();
-    
+                    lexer->streamIndex = scanners.findAny(lexer->inputStream, lexer->streamIndex, lexer->streamLength, blockCommentStops);
                 }
                 break;
                 
             case STATE_IN_BLOCK_COMMENT_TILDE:
                 if (currentChar == '~') {
-                    lexemeBuffer[lexemeIndex++] = getChar(); 
+                    getChar(lexer); 
                     currentState = STATE_DONE;
-                    return createToken(Token_Block_Comment, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Block_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else if (currentChar == '\0') {
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, "Unclosed block comment", 22);
+                    return createErrorToken(Diag_Unclosed_Block_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 else {
                     currentState = STATE_IN_BLOCK_COMMENT;
                 }
                 break;
-                
-            case STATE_IN_I:
-                if(currentChar == 'V'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_V;
-                    
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
-                }
-                else{
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
-                }
-                break;
-            
-            case STATE_IN_V:
-                if(is_space(currentChar)){ 
-                    currentState = STATE_DONE;
-                    return createToken(Token_Arithmetic_Operator, lexemeBuffer, lexemeIndex);
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
-                }
-                else{ 
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
-                }
-                break;
-                
-            case STATE_IN_O:
-                if(currentChar == 'r'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_R;
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
-                }
-                else{
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
+
+            case STATE_IN_EQUAL:
+                if(is_space(currentChar)){
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Assignment_Operator, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
-                break;
-            
-            case STATE_IN_R:
-                if(is_space(currentChar)){ 
+                else if(currentChar == '='){
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Boolean_Operator, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Boolean_Operator, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
+                else if((unsigned char)currentChar >= 0x80){
+                    // unknown, taking the whole character
+                    getChar(lexer);
+                    currentState = STATE_IN_UTF8;
                 }
                 else{ 
                     //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
+                    getChar(lexer);
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Unknown, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 break;
 
-            case STATE_IN_A:
-                if(currentChar == 'n'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_N;
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
+            case STATE_IN_UTF8:
+                // one unknown character, however many bytes it takes
+                if(((unsigned char)currentChar & 0xC0) == 0x80){
+                    getChar(lexer);
                 }
                 else{
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
                     currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
+                    return createToken(Token_Unknown, lexemeStart, lexer->streamIndex - lexemeStart);
                 }
                 break;
 
-            case STATE_IN_N:
-                if(currentChar == 'd'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_D_AND;
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
-                }
-                else{
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
-                }
+            case STATE_DONE:
                 break;
 
-            case STATE_IN_D_AND:
-                if(is_space(currentChar)){
-                    currentState = STATE_DONE;
-                    return createToken(Token_Boolean_Operator, lexemeBuffer, lexemeIndex);
-                }
-                else if(is_alphanumeric(currentChar) || currentChar == '_'){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_IN_IDENTIFIER;
-                }
-                else{ 
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
-                }
-                break;
+        }
+    }
+    return createToken(Token_CodeEnd, lexer->streamIndex, 0);
+}
 
-            case STATE_IN_EQUAL:
-                if(is_space(currentChar)){
-                    currentState = STATE_DONE;
-                    return createToken(Token_Assignment_Operator, lexemeBuffer, lexemeIndex);
-                }
-                else if(currentChar == '='){
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Boolean_Operator, lexemeBuffer, lexemeIndex);
-                }
-                else{ 
-                    //unkown
-                    lexemeBuffer[lexemeIndex++] = getChar();
-                    currentState = STATE_DONE;
-                    return createToken(Token_Unknown, lexemeBuffer, lexemeIndex);
-                }
-                break;
+Token getNextTokenSwitch(Lexer* lexer){
+    int from = lexer->streamIndex;
+    Token token = scanTokenSwitch(lexer);
+    if(lexer->streamIndex > lexer->utf8Checked) token = checkTokenUtf8(lexer, token, from);
+    return token;
+}
 
-            case STATE_DONE:
-                break;
+// getNextToken() uses the threaded backend below wherever the compiler has
+// labels as values (GCC, Clang); elsewhere, or when built with
+// -DLEXER_SWITCH_DISPATCH, it uses the switch. Both give the same tokens.
+#if defined(__GNUC__) && !defined(LEXER_SWITCH_DISPATCH)
+#define LEXER_THREADED_DISPATCH 1
+#endif
 
-        }
+#ifdef LEXER_THREADED_DISPATCH
+// The same automaton as scanTokenSwitch(), with one label per state. Every
+// transition is a direct goto to the next state's label, so each state
+// ends in its own branch instead of all of them sharing the switch's one
+// indirect jump, and STATE_START dispatches on the byte's class through a
+// table of label addresses instead of the strchr/is_* chain. A NUL byte stops
+// STATE_START like the end of input does.
+#define THREADED_STATE(label, state) \
+    label: currentChar = peekChar(lexer); LEXER_STATS_STATE(state)
+
+static Token scanTokenThreaded(Lexer* lexer){
+    // what STATE_START does with each byte; unlisted bytes are unknown
+    enum { START_UNKNOWN, START_END, START_SPACE, START_DELIMITER, START_ARITHMETIC, START_IDENTIFIER,
+           START_NUMBER, START_CHAR, START_STRING, START_TILDE, START_EQUAL, START_UTF8 };
+    static const unsigned char startClass[256] = {
+        ['\0'] = START_END,
+        [' '] = START_SPACE, ['\t'] = START_SPACE, ['\n'] = START_SPACE,
+        ['('] = START_DELIMITER, [')'] = START_DELIMITER, ['['] = START_DELIMITER,
+        [']'] = START_DELIMITER, ['{'] = START_DELIMITER, ['}'] = START_DELIMITER,
+        [','] = START_DELIMITER,
+        ['+'] = START_ARITHMETIC, ['-'] = START_ARITHMETIC, ['*'] = START_ARITHMETIC,
+        ['%'] = START_ARITHMETIC, ['/'] = START_ARITHMETIC, ['^'] = START_ARITHMETIC,
+        ['a' ... 'z'] = START_IDENTIFIER, ['A' ... 'Z'] = START_IDENTIFIER, ['_'] = START_IDENTIFIER,
+        ['0' ... '9'] = START_NUMBER,
+        ['\''] = START_CHAR,
+        ['\"'] = START_STRING,
+        ['~'] = START_TILDE,
+        ['='] = START_EQUAL,
+        [0x80 ... 0xFF] = START_UTF8,
+    };
+    static const void* const startDispatch[] = {
+        &&startUnknown, &&startEnd, &&startSpace, &&startDelimiter, &&startArithmetic, &&startIdentifier,
+        &&startNumber, &&startChar, &&startString, &&startTilde, &&startEqual, &&startUtf8,
+    };
+    int lexemeStart = lexer->streamIndex;
+    bool hasEscapes = false;
+    char currentChar;
+
+THREADED_STATE(inStart, STATE_START);
+    lexemeStart = lexer->streamIndex;
+    goto *startDispatch[startClass[(unsigned char)currentChar]];
+startEnd:
+    return createToken(Token_CodeEnd, lexer->streamIndex, 0);
+startSpace:
+    getChar(lexer);
+    // single separators are the common case, only runs go wide
+    if(is_space(peekChar(lexer))){
+        lexer->streamIndex = scanners.skipSpaces(lexer->inputStream, lexer->streamIndex, lexer->streamLength);
+    }
+    goto inStart;
+startDelimiter:
+    getChar(lexer);
+    return createToken(Token_Delimeter, lexemeStart, 1);
+startArithmetic:
+    getChar(lexer);
+    return createToken(Token_Arithmetic_Operator, lexemeStart, 1);
+startIdentifier:
+    getChar(lexer);
+    goto inIdentifier;
+startNumber:
+    getChar(lexer);
+    goto inNumber;
+startChar:
+    getChar(lexer);
+    goto inChar;
+startString:
+    getChar(lexer);
+    goto inString;
+startTilde:
+    getChar(lexer);
+    goto inTilde;
+startEqual:
+    getChar(lexer);
+    goto inEqual;
+startUtf8:
+    getChar(lexer);
+    if(lexer->unicodeIdentifiers) goto inIdentifier;
+    goto inUtf8;
+startUnknown:
+    getChar(lexer);
+    return createToken(Token_Unknown, lexemeStart, 1);
+
+THREADED_STATE(inIdentifier, STATE_IN_IDENTIFIER);
+    if(isIdentifierChar(currentChar, lexer->unicodeIdentifiers)){
+        getChar(lexer);
+        goto inIdentifier;
+    }
+    return finishIdentifier(lexer, lexemeStart);
+
+THREADED_STATE(inNumber, STATE_IN_NUMBER);
+    return finishNumber(lexer, lexemeStart);
+
+THREADED_STATE(inChar, STATE_IN_CHAR);
+    if(currentChar == '\\'){
+        getChar(lexer);
+        goto inCharEscape;
+    }
+    if(currentChar == '\n' || currentChar == '\0'){
+        return createErrorToken(Diag_Unclosed_Char, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    if(currentChar == '\''){
+        getChar(lexer);
+        return createErrorToken(Diag_Empty_Char, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    getChar(lexer);
+    goto inCharExpectClose;
+
+THREADED_STATE(inCharExpectClose, STATE_IN_CHAR_EXPECT_CLOSE);
+    if(currentChar == '\''){
+        getChar(lexer);
+        Token token = createToken(Token_Character, lexemeStart + 1, lexer->streamIndex - lexemeStart - 2);
+        if(hasEscapes) token.flags = TOKEN_HAS_ESCAPES;
+        return token;
+    }
+    if(((unsigned char)currentChar & 0xC0) == 0x80){
+        getChar(lexer);
+        goto inCharExpectClose;
+    }
+    return createErrorToken(Diag_Multi_Char, lexemeStart, lexer->streamIndex - lexemeStart);
+
+THREADED_STATE(inCharEscape, STATE_IN_CHAR_ESCAPE);
+    if(currentChar != 'n' && currentChar != 't' && currentChar != '\'' && currentChar != '\\'){
+        return createErrorToken(Diag_Invalid_Escape, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    getChar(lexer);
+    hasEscapes = true;
+    goto inCharExpectClose;
+
+THREADED_STATE(inString, STATE_IN_STRING);
+    if(currentChar == '\\'){
+        getChar(lexer);
+        goto inStringEscape;
+    }
+    if(currentChar == '\"'){
+        getChar(lexer);
+        Token token = createToken(Token_String, lexemeStart + 1, lexer->streamIndex - lexemeStart - 2);
+        if(hasEscapes) token.flags = TOKEN_HAS_ESCAPES;
+        return token;
+    }
+    if(currentChar == '\n' || currentChar == '\0'){
+        return createErrorToken(Diag_Unclosed_String, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    lexer->streamIndex = scanners.findAny(lexer->inputStream, lexer->streamIndex, lexer->streamLength, stringStops);
+    goto inString;
+
+THREADED_STATE(inStringEscape, STATE_IN_STRING_ESCAPE);
+    if(currentChar != 'n' && currentChar != 't' && currentChar != '\"' && currentChar != '\\'){
+        return createErrorToken(Diag_Invalid_Escape, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    getChar(lexer);
+    hasEscapes = true;
+    goto inString;
+
+THREADED_STATE(inTilde, STATE_IN_TILDE);
+    if(currentChar == '/'){
+        getChar(lexer);
+        goto inBlockComment;
+    }
+    goto inSingleLineComment;
+
+THREADED_STATE(inSingleLineComment, STATE_IN_SINGLE_LINE_COMMENT);
+    if(currentChar == '\n' || currentChar == '\0'){
+        return createToken(Token_Single_Line_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    lexer->streamIndex = scanners.findAny(lexer->inputStream, lexer->streamIndex, lexer->streamLength, lineCommentStops);
+    goto inSingleLineComment;
+
+THREADED_STATE(inBlockComment, STATE_IN_BLOCK_COMMENT);
+    if(currentChar == '/'){
+        getChar(lexer);
+        goto inBlockCommentTilde;
     }
-    return createToken(Token_CodeEnd, "EOF", 3);
+    if(currentChar == '\0'){
+        return createErrorToken(Diag_Unclosed_Block_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    lexer->streamIndex = scanners.findAny(lexer->inputStream, lexer->streamIndex, lexer->streamLength, blockCommentStops);
+    goto inBlockComment;
+
+THREADED_STATE(inBlockCommentTilde, STATE_IN_BLOCK_COMMENT_TILDE);
+    if(currentChar == '~'){
+        getChar(lexer);
+        return createToken(Token_Block_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    if(currentChar == '\0'){
+        return createErrorToken(Diag_Unclosed_Block_Comment, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    goto inBlockComment;
+
+THREADED_STATE(inEqual, STATE_IN_EQUAL);
+    if(is_space(currentChar)){
+        return createToken(Token_Assignment_Operator, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    if(currentChar == '='){
+        getChar(lexer);
+        return createToken(Token_Boolean_Operator, lexemeStart, lexer->streamIndex - lexemeStart);
+    }
+    getChar(lexer);
+    // unknown, taking the whole character when it is multibyte
+    if((unsigned char)currentChar >= 0x80) goto inUtf8;
+    return createToken(Token_Unknown, lexemeStart, lexer->streamIndex - lexemeStart);
+
+THREADED_STATE(inUtf8, STATE_IN_UTF8);
+    if(((unsigned char)currentChar & 0xC0) == 0x80){
+        getChar(lexer);
+        goto inUtf8;
+    }
+    return createToken(Token_Unknown, lexemeStart, lexer->streamIndex - lexemeStart);
+}
+#undef THREADED_STATE
+
+Token getNextTokenThreaded(Lexer* lexer){
+    int from = lexer->streamIndex;
+    Token token = scanTokenThreaded(lexer);
+    if(lexer->streamIndex > lexer->utf8Checked) token = checkTokenUtf8(lexer, token, from);
+    return token;
+}
+#endif
+
+Token getNextToken(Lexer* lexer){
+#ifdef LEXER_THREADED_DISPATCH
+    return getNextTokenThreaded(lexer);
+#else
+    return getNextTokenSwitch(lexer);
+#endif
 }
 //getNextToken Function
 
-int main(){
-    printf("Hello, world!\n");
-    return 0;
+//Table-Driven Automaton
+// Same token language as getNextToken(), but every byte is first mapped to
+// a class and the next step is a single lookup in a dense state x class
+// table, instead of a chain of strchr/is_* tests.
+typedef enum {
+    CLASS_EOF,       // end of input or a NUL byte
+    CLASS_SPACE,
+    CLASS_NEWLINE,
+    CLASS_DELIM,
+    CLASS_ARITH,
+    CLASS_SLASH,
+    CLASS_LETTER,    // letters and '_' without a role of their own
+    CLASS_DIGIT,
+    CLASS_SQUOTE,
+    CLASS_DQUOTE,
+    CLASS_TILDE,
+    CLASS_EQUAL,
+    CLASS_BACKSLASH,
+    CLASS_PERIOD,
+    // letters that are also escape characters
+    CLASS_LOWER_N,
+    CLASS_LOWER_T,
+    CLASS_UTF8_LEAD,  // 0xC0-0xFF
+    CLASS_UTF8_CONT,  // 0x80-0xBF
+    CLASS_OTHER,
+    CLASS_COUNT
+} Byte_Class;
+
+// Transition entry layout. Rows are padded to a power of two and entries
+// hold the next row offset, so a step is a shift-free indexed load.
+#define DFA_ROW_SIZE     32
+#define DFA_ROW_MASK     0x3FF  // next AutomatonState * DFA_ROW_SIZE
+#define DFA_CONSUME      0x400  // advance past the current byte
+#define DFA_TYPE_SHIFT   16     // Token_Type emitted on STATE_DONE
+#define DFA_DIAG_SHIFT   24     // Lexer_Diagnostic emitted on STATE_DONE
+
+static unsigned char byteClass[256];
+static unsigned int dfaTable[STATE_DONE + 1][DFA_ROW_SIZE];
+// dfaTable with non-ASCII characters as identifier characters
+static unsigned int dfaUnicodeTable[STATE_DONE + 1][DFA_ROW_SIZE];
+static pthread_once_t dfaTablesOnce = PTHREAD_ONCE_INIT;
+
+static unsigned int dfaGoto(AutomatonState next, bool consume){
+    return (next * DFA_ROW_SIZE) | (consume ? DFA_CONSUME : 0);
+}
+static unsigned int dfaEmit(Token_Type type, bool consume){
+    return dfaGoto(STATE_DONE, consume) | ((unsigned int)type << DFA_TYPE_SHIFT);
+}
+static unsigned int dfaError(Lexer_Diagnostic diagnostic, bool consume){
+    return dfaEmit(Token_Unknown, consume) | ((unsigned int)diagnostic << DFA_DIAG_SHIFT);
 }
+static void dfaFill(AutomatonState state, unsigned int action){
+    for(int c = 0; c < CLASS_COUNT; c++) dfaTable[state][c] = action;
+}
+static void dfaFillIdentifierChars(AutomatonState state, unsigned int action){
+    static const Byte_Class identifierClasses[] = {
+        CLASS_LETTER, CLASS_DIGIT, CLASS_LOWER_N, CLASS_LOWER_T
+    };
+    for(size_t i = 0; i < sizeof(identifierClasses) / sizeof(identifierClasses[0]); i++){
+        dfaTable[state][identifierClasses[i]] = action;
+    }
+}
+static void buildDfaTables(){
+    for(int c = 0; c < 256; c++){
+        if(is_alpha((char)c) || c == '_') byteClass[c] = CLASS_LETTER;
+        else if(is_digit((char)c)) byteClass[c] = CLASS_DIGIT;
+        else if(c >= 0xC0) byteClass[c] = CLASS_UTF8_LEAD;
+        else if(c >= 0x80) byteClass[c] = CLASS_UTF8_CONT;
+        else byteClass[c] = CLASS_OTHER;
+    }
+    for(const char* p = "()[]{},"; *p; p++) byteClass[(unsigned char)*p] = CLASS_DELIM;
+    for(const char* p = "+-*%^"; *p; p++) byteClass[(unsigned char)*p] = CLASS_ARITH;
+    byteClass['\0'] = CLASS_EOF;
+    byteClass[' '] = CLASS_SPACE;
+    byteClass['\t'] = CLASS_SPACE;
+    byteClass['\n'] = CLASS_NEWLINE;
+    byteClass['/'] = CLASS_SLASH;
+    byteClass['\''] = CLASS_SQUOTE;
+    byteClass['\"'] = CLASS_DQUOTE;
+    byteClass['~'] = CLASS_TILDE;
+    byteClass['='] = CLASS_EQUAL;
+    byteClass['\\'] = CLASS_BACKSLASH;
+    byteClass['.'] = CLASS_PERIOD;
+    byteClass['n'] = CLASS_LOWER_N;
+    byteClass['t'] = CLASS_LOWER_T;
 
-Token getNextToken(FILE* srcFile){
-    Token token;
-    int state = 0; // Start state
-    char ch; // Current character
-    int lexemeIndex = 0; // Index for lexeme
-    token.line_number = 1; // Initialize line number
-    memset(token.lexeme, 0, MAX_LEXEME_LENGTH); // Clear lexeme buffer
-
-    while((ch = fgetc(srcFile)) != EOF){
-        switch(state){
-            case 0: // Start state
-                if(isspace(ch)){
-                    if(ch == '\n') token.line_number++;
-                    continue; // Ignore whitespace
-                }
-                else token.lexeme[lexemeIndex++] = ch; // Add character to lexeme
-
-                if(isalpha(ch) || ch == '_') state = 1; // Identifier state
-                else if(isdigit(ch)) state = 2; // Number state
-                else if(ch == '~') state = 3; // Comment state
-                else if(ch == '"') state = 4; // String state
-                else if(ch == '\'') state = 5; // Character state
-                //else if(strchr("+-*=%!<>", ch)) state = 6; // Operator state
-                else if(strchr("(){}[],.;", ch)) state = 7; // Delimeter state
-                else {
-                    token.lexeme[lexemeIndex] = '\0';
-                    token.type = getlexemeType(token.lexeme);
-                    return token; // Return single character tokens
-                }
-                break;
+    dfaFill(STATE_START, dfaEmit(Token_Unknown, true));
+    dfaFillIdentifierChars(STATE_START, dfaGoto(STATE_IN_IDENTIFIER, true));
+    dfaTable[STATE_START][CLASS_EOF] = dfaEmit(Token_CodeEnd, false);
+    // leading whitespace is skipped before the table loop runs
+    dfaTable[STATE_START][CLASS_SPACE] = dfaGoto(STATE_START, true);
+    dfaTable[STATE_START][CLASS_NEWLINE] = dfaGoto(STATE_START, true);
+    dfaTable[STATE_START][CLASS_DELIM] = dfaEmit(Token_Delimeter, true);
+    dfaTable[STATE_START][CLASS_ARITH] = dfaEmit(Token_Arithmetic_Operator, true);
+    dfaTable[STATE_START][CLASS_SLASH] = dfaEmit(Token_Arithmetic_Operator, true);
+    dfaTable[STATE_START][CLASS_DIGIT] = dfaGoto(STATE_IN_NUMBER, true);
+    dfaTable[STATE_START][CLASS_SQUOTE] = dfaGoto(STATE_IN_CHAR, true);
+    dfaTable[STATE_START][CLASS_DQUOTE] = dfaGoto(STATE_IN_STRING, true);
+    dfaTable[STATE_START][CLASS_TILDE] = dfaGoto(STATE_IN_TILDE, true);
+    dfaTable[STATE_START][CLASS_EQUAL] = dfaGoto(STATE_IN_EQUAL, true);
+    dfaTable[STATE_START][CLASS_UTF8_LEAD] = dfaGoto(STATE_IN_UTF8, true);
+    dfaTable[STATE_START][CLASS_UTF8_CONT] = dfaGoto(STATE_IN_UTF8, true);
 
-            case 1: // Identifier state
-                if(isalnum(ch) || ch == '_'){
-                    token.lexeme[lexemeIndex++] = ch;
-                } else {
-                    ungetc(ch, srcFile); // Put back the non-identifier character
-                    token.lexeme[lexemeIndex] = '\0';
-                    token.type = getlexemeType(token.lexeme);
-                    return token;
-                }
-                break;
+    dfaFill(STATE_IN_UTF8, dfaEmit(Token_Unknown, false));
+    dfaTable[STATE_IN_UTF8][CLASS_UTF8_CONT] = dfaGoto(STATE_IN_UTF8, true);
 
-            case 2: // Number state
-                if(isdigit(ch) || ch == '.') token.lexeme[lexemeIndex++] = ch;
-                else { // Not a number character
-                    ungetc(ch, srcFile); // Put back the non-number character
-                    token.lexeme[lexemeIndex] = '\0';
-                    token.type = Token_Number;
-                    return token;
-                }
-                break;
-            
-            case 3: // Comment state (not implemented)
-                // Handle comments  here
-                break;
+    dfaFill(STATE_IN_IDENTIFIER, dfaEmit(Token_Identifier, false));
+    dfaFillIdentifierChars(STATE_IN_IDENTIFIER, dfaGoto(STATE_IN_IDENTIFIER, true));
 
-            case 4: // String state (not implemented)
-                if(ch != '"'){
-                    token.lexeme[lexemeIndex++] = ch; // Add character to string
-                } 
-                else { // End of string
-                    token.lexeme[lexemeIndex] = '\0';
-                    token.type = Token_String;
-                    return token;
+    dfaFill(STATE_IN_NUMBER, dfaEmit(Token_Number, false));
+    dfaTable[STATE_IN_NUMBER][CLASS_DIGIT] = dfaGoto(STATE_IN_NUMBER, true);
+    dfaTable[STATE_IN_NUMBER][CLASS_PERIOD] = dfaGoto(STATE_IN_DECIMAL, true);
+    dfaFill(STATE_IN_DECIMAL, dfaEmit(Token_Number, false));
+    dfaTable[STATE_IN_DECIMAL][CLASS_DIGIT] = dfaGoto(STATE_IN_DECIMAL, true);
+
+    dfaFill(STATE_IN_CHAR, dfaGoto(STATE_IN_CHAR_EXPECT_CLOSE, true));
+    dfaTable[STATE_IN_CHAR][CLASS_BACKSLASH] = dfaGoto(STATE_IN_CHAR_ESCAPE, true);
+    dfaTable[STATE_IN_CHAR][CLASS_NEWLINE] = dfaError(Diag_Unclosed_Char, false);
+    dfaTable[STATE_IN_CHAR][CLASS_EOF] = dfaError(Diag_Unclosed_Char, false);
+    dfaTable[STATE_IN_CHAR][CLASS_SQUOTE] = dfaError(Diag_Empty_Char, true);
+
+    dfaFill(STATE_IN_CHAR_EXPECT_CLOSE, dfaError(Diag_Multi_Char, false));
+    dfaTable[STATE_IN_CHAR_EXPECT_CLOSE][CLASS_SQUOTE] = dfaEmit(Token_Character, true);
+    dfaTable[STATE_IN_CHAR_EXPECT_CLOSE][CLASS_UTF8_CONT] = dfaGoto(STATE_IN_CHAR_EXPECT_CLOSE, true);
+
+    dfaFill(STATE_IN_CHAR_ESCAPE, dfaError(Diag_Invalid_Escape, false));
+    dfaTable[STATE_IN_CHAR_ESCAPE][CLASS_LOWER_N] = dfaGoto(STATE_IN_CHAR_EXPECT_CLOSE, true);
+    dfaTable[STATE_IN_CHAR_ESCAPE][CLASS_LOWER_T] = dfaGoto(STATE_IN_CHAR_EXPECT_CLOSE, true);
+    dfaTable[STATE_IN_CHAR_ESCAPE][CLASS_SQUOTE] = dfaGoto(STATE_IN_CHAR_EXPECT_CLOSE, true);
+    dfaTable[STATE_IN_CHAR_ESCAPE][CLASS_BACKSLASH] = dfaGoto(STATE_IN_CHAR_EXPECT_CLOSE, true);
+
+    dfaFill(STATE_IN_STRING, dfaGoto(STATE_IN_STRING, true));
+    dfaTable[STATE_IN_STRING][CLASS_BACKSLASH] = dfaGoto(STATE_IN_STRING_ESCAPE, true);
+    dfaTable[STATE_IN_STRING][CLASS_DQUOTE] = dfaEmit(Token_String, true);
+    dfaTable[STATE_IN_STRING][CLASS_NEWLINE] = dfaError(Diag_Unclosed_String, false);
+    dfaTable[STATE_IN_STRING][CLASS_EOF] = dfaError(Diag_Unclosed_String, false);
+
+    dfaFill(STATE_IN_STRING_ESCAPE, dfaError(Diag_Invalid_Escape, false));
+    dfaTable[STATE_IN_STRING_ESCAPE][CLASS_LOWER_N] = dfaGoto(STATE_IN_STRING, true);
+    dfaTable[STATE_IN_STRING_ESCAPE][CLASS_LOWER_T] = dfaGoto(STATE_IN_STRING, true);
+    dfaTable[STATE_IN_STRING_ESCAPE][CLASS_DQUOTE] = dfaGoto(STATE_IN_STRING, true);
+    dfaTable[STATE_IN_STRING_ESCAPE][CLASS_BACKSLASH] = dfaGoto(STATE_IN_STRING, true);
+
+    dfaFill(STATE_IN_TILDE, dfaGoto(STATE_IN_SINGLE_LINE_COMMENT, false));
+    dfaTable[STATE_IN_TILDE][CLASS_SLASH] = dfaGoto(STATE_IN_BLOCK_COMMENT, true);
+
+    dfaFill(STATE_IN_SINGLE_LINE_COMMENT, dfaGoto(STATE_IN_SINGLE_LINE_COMMENT, true));
+    dfaTable[STATE_IN_SINGLE_LINE_COMMENT][CLASS_NEWLINE] = dfaEmit(Token_Single_Line_Comment, false);
+    dfaTable[STATE_IN_SINGLE_LINE_COMMENT][CLASS_EOF] = dfaEmit(Token_Single_Line_Comment, false);
+
+    dfaFill(STATE_IN_BLOCK_COMMENT, dfaGoto(STATE_IN_BLOCK_COMMENT, true));
+    dfaTable[STATE_IN_BLOCK_COMMENT][CLASS_SLASH] = dfaGoto(STATE_IN_BLOCK_COMMENT_TILDE, true);
+    dfaTable[STATE_IN_BLOCK_COMMENT][CLASS_EOF] = dfaError(Diag_Unclosed_Block_Comment, false);
+
+    dfaFill(STATE_IN_BLOCK_COMMENT_TILDE, dfaGoto(STATE_IN_BLOCK_COMMENT, false));
+    dfaTable[STATE_IN_BLOCK_COMMENT_TILDE][CLASS_TILDE] = dfaEmit(Token_Block_Comment, true);
+    dfaTable[STATE_IN_BLOCK_COMMENT_TILDE][CLASS_EOF] = dfaError(Diag_Unclosed_Block_Comment, false);
+
+    dfaFill(STATE_IN_EQUAL, dfaEmit(Token_Unknown, true));
+    dfaTable[STATE_IN_EQUAL][CLASS_SPACE] = dfaEmit(Token_Assignment_Operator, false);
+    dfaTable[STATE_IN_EQUAL][CLASS_NEWLINE] = dfaEmit(Token_Assignment_Operator, false);
+    dfaTable[STATE_IN_EQUAL][CLASS_EQUAL] = dfaEmit(Token_Boolean_Operator, true);
+    dfaTable[STATE_IN_EQUAL][CLASS_UTF8_LEAD] = dfaGoto(STATE_IN_UTF8, true);
+    dfaTable[STATE_IN_EQUAL][CLASS_UTF8_CONT] = dfaGoto(STATE_IN_UTF8, true);
+
+    // end of input is never consumed
+    for(int s = 0; s <= STATE_DONE; s++) dfaTable[s][CLASS_EOF] &= ~DFA_CONSUME;
+
+    memcpy(dfaUnicodeTable, dfaTable, sizeof(dfaTable));
+    dfaUnicodeTable[STATE_START][CLASS_UTF8_LEAD] = dfaGoto(STATE_IN_IDENTIFIER, true);
+    dfaUnicodeTable[STATE_START][CLASS_UTF8_CONT] = dfaGoto(STATE_IN_IDENTIFIER, true);
+    dfaUnicodeTable[STATE_IN_IDENTIFIER][CLASS_UTF8_LEAD] = dfaGoto(STATE_IN_IDENTIFIER, true);
+    dfaUnicodeTable[STATE_IN_IDENTIFIER][CLASS_UTF8_CONT] = dfaGoto(STATE_IN_IDENTIFIER, true);
+}
+
+// initLexer() calls this, so lexers never see unbuilt tables; later calls
+// are cheap
+void initDfaTables(){
+    pthread_once(&dfaTablesOnce, buildDfaTables);
+}
+
+static Token scanTokenDfa(Lexer* lexer){
+    const unsigned char* input = (const unsigned char*)lexer->inputStream;
+    int length = lexer->streamLength;
+    int index = lexer->streamIndex;
+    const unsigned int* table = lexer->unicodeIdentifiers ? &dfaUnicodeTable[0][0] : &dfaTable[0][0];
+    unsigned int row = STATE_START * DFA_ROW_SIZE;
+    unsigned int action;
+
+    // whitespace is the only self-loop on STATE_START, skip it up front so
+    // the table loop never has to move lexemeStart
+    while(index < length && (input[index] == ' ' || input[index] == '\t' || input[index] == '\n')) index++;
+    int lexemeStart = index;
+
+    do{
+        LEXER_STATS_STATE(row / DFA_ROW_SIZE);
+        unsigned int c = index < length ? byteClass[input[index]] : CLASS_EOF;
+        action = table[row + c];
+        // keep this a real branch: it is nearly always taken, and a
+        // conditional move would chain every load on the previous lookup
+        if(action & DFA_CONSUME){
+            index++;
+            __asm__ volatile("");
+        }
+        row = action & DFA_ROW_MASK;
+    }while(row != STATE_DONE * DFA_ROW_SIZE);
+
+    lexer->streamIndex = index;
+
+    Token_Type type = (Token_Type)((action >> DFA_TYPE_SHIFT) & 0xFF);
+    if(type == Token_Number){
+        int end;
+        return lexNumber(lexer->inputStream, lexemeStart, index, &end);
+    }
+    if(type == Token_Identifier){
+        type = getlexemeType(lexer->inputStream + lexemeStart, index - lexemeStart);
+    }
+    if(type == Token_String || type == Token_Character){
+        Token token = createToken(type, lexemeStart + 1, index - lexemeStart - 2);
+        // the table does not track escapes; a valid body has a backslash only as one
+        if(memchr(input + token.offset, '\\', token.length)) token.flags = TOKEN_HAS_ESCAPES;
+        return token;
+    }
+    Token token = createToken(type, lexemeStart, index - lexemeStart);
+    token.diagnostic = (unsigned char)(action >> DFA_DIAG_SHIFT);
+    if(type == Token_Identifier && lexer->symbols){
+        token.symbol = internSymbol(lexer->symbols, lexer->inputStream + lexemeStart, token.length);
+    }
+    return token;
+}
+
+Token getNextTokenDfa(Lexer* lexer){
+    int from = lexer->streamIndex;
+    Token token = scanTokenDfa(lexer);
+    if(lexer->streamIndex > lexer->utf8Checked) token = checkTokenUtf8(lexer, token, from);
+    return token;
+}
+//Table-Driven Automaton
+
+//Skim Mode
+// For callers that want only some token types, such as the identifiers and
+// keywords of a search index. skimToken() returns the next token whose type
+// is in mask, or Token_CodeEnd, and moves past everything else without
+// building tokens. Whitespace, delimiters and operators are skipped a byte
+// at a time by one tight loop. Comments and strings go through the
+// vectorized scanners, and numbers are skipped without being converted.
+// Anything without a fast path goes through getNextToken(), so the result
+// is always the full token stream filtered by mask. Spans that could come
+// back as Token_Unknown are only skipped blind (no UTF-8 check, no escape
+// or range errors) when mask leaves Token_Unknown out.
+#define TOKEN_BIT(type) (1ULL << (type))
+// every type an identifier-shaped lexeme can get, see keywords[]
+#define SKIM_WORD_TYPES (TOKEN_BIT(Token_Identifier) | TOKEN_BIT(Token_Boolean_Operator) | \
+                         TOKEN_BIT(Token_Arithmetic_Operator_DIV) | \
+                         (TOKEN_BIT(Token_Noise_Do + 1) - TOKEN_BIT(Token_Keyword_If)))
+// byte classes that continue an ASCII identifier
+#define SKIM_NAME_CLASSES ((1u << CLASS_LETTER) | (1u << CLASS_LOWER_N) | (1u << CLASS_LOWER_T) | (1u << CLASS_DIGIT))
+
+// End of the string whose body starts at index, as STATE_IN_STRING ends it
+static int skipStringBody(const char* input, int index, int length){
+    for(;;){
+        index = scanners.findAny(input, index, length, stringStops);
+        if(index >= length) return length;
+        char c = input[index];
+        if(c == '\"') return index + 1;
+        if(c != '\\') return index;  // unclosed at a newline or NUL
+        char escaped = index + 1 < length ? input[index + 1] : '\0';
+        // a bad escape ends the token just after the backslash
+        if(escaped != 'n' && escaped != 't' && escaped != '\"' && escaped != '\\') return index + 1;
+        index += 2;
+    }
+}
+
+// End of the comment whose '~' is just before index
+static int skipCommentBody(const char* input, int index, int length){
+    if(index >= length || input[index] != '/'){
+        return scanners.findAny(input, index, length, lineCommentStops);
+    }
+    index++;
+    for(;;){
+        index = scanners.findAny(input, index, length, blockCommentStops);
+        if(index >= length || input[index] == '\0') return index;  // unclosed
+        index++;
+        if(index < length && input[index] == '~') return index + 1;
+    }
+}
+
+Token skimToken(Lexer* lexer, unsigned long long mask){
+    const char* input = lexer->inputStream;
+    int length = lexer->streamLength;
+    bool blind = !(mask & TOKEN_BIT(Token_Unknown));
+    // one-byte tokens the caller does not want: skipped by a single loop
+    // whose branch stays predictable, however they are mixed
+    unsigned int skipped = (1u << CLASS_SPACE) | (1u << CLASS_NEWLINE);
+    if(!(mask & TOKEN_BIT(Token_Delimeter))) skipped |= 1u << CLASS_DELIM;
+    if(!(mask & TOKEN_BIT(Token_Arithmetic_Operator))) skipped |= (1u << CLASS_ARITH) | (1u << CLASS_SLASH);
+    if(blind) skipped |= (1u << CLASS_BACKSLASH) | (1u << CLASS_PERIOD) | (1u << CLASS_OTHER);
+    int index = lexer->streamIndex;
+
+    for(;;){
+        while(index < length && (skipped >> byteClass[(unsigned char)input[index]] & 1)) index++;
+        if(index >= length) break;
+        int start = index;
+        switch(byteClass[(unsigned char)input[index]]){
+            case CLASS_EOF:
+                lexer->streamIndex = index;
+                return createToken(Token_CodeEnd, index, 0);
+
+            case CLASS_EQUAL:{
+                char next = index + 1 < length ? input[index + 1] : '\0';
+                if(next == '='){
+                    if(mask & TOKEN_BIT(Token_Boolean_Operator)) break;
+                    index += 2;
                 }
-                break;
+                else if(is_space(next)){
+                    if(mask & TOKEN_BIT(Token_Assignment_Operator)) break;
+                    index++;
+                }
+                // '=' glued to anything else is unknown
+                else break;
+                continue;
+            }
 
-            case 5: // Character state (not implemented)
-                if(ch != '\''){
-                    token.lexeme[lexemeIndex++] = ch; // Add character to char
-                } 
-                else { // End of character
-                    token.lexeme[lexemeIndex] = '\0';
-                    token.type = Token_Character;
-                    return token;
+            case CLASS_LETTER:
+            case CLASS_LOWER_N:
+            case CLASS_LOWER_T:{
+                index++;
+                while(index < length && (SKIM_NAME_CLASSES >> byteClass[(unsigned char)input[index]] & 1)) index++;
+                // a non-ASCII character continues the name
+                if(lexer->unicodeIdentifiers && index < length && (unsigned char)input[index] >= 0x80) break;
+                if(!(mask & SKIM_WORD_TYPES)) continue;
+                lexer->streamIndex = index;
+                Token token = finishIdentifier(lexer, start);
+                if(mask & TOKEN_BIT(token.type)) return token;
+                continue;
+            }
+
+            case CLASS_DIGIT:
+                if(!blind || (mask & TOKEN_BIT(Token_Number))) break;
+                while(index < length && is_digit(input[index])) index++;
+                if(index < length && input[index] == '.'){
+                    index++;
+                    while(index < length && is_digit(input[index])) index++;
                 }
-                break;
+                continue;
 
-            case 6: // Operator state (not implemented)
-                // Handle multi-character operators here
-                break;
+            case CLASS_DQUOTE:
+                if(!blind || (mask & TOKEN_BIT(Token_String))) break;
+                index = skipStringBody(input, index + 1, length);
+                continue;
 
-            case 7: // Delimeter state (not implemented)
-                // Handle delimeters here
-                break;
+            case CLASS_TILDE:
+                if(!blind || (mask & (TOKEN_BIT(Token_Single_Line_Comment) | TOKEN_BIT(Token_Block_Comment)))) break;
+                index = skipCommentBody(input, index + 1, length);
+                continue;
+
+            case CLASS_UTF8_LEAD:
+            case CLASS_UTF8_CONT:
+                if(!blind || lexer->unicodeIdentifiers) break;
+                index++;
+                while(index < length && ((unsigned char)input[index] & 0xC0) == 0x80) index++;
+                continue;
 
-            case 8: // End of file state
-                token.type = Token_CodeEnd;
-                return token;
-            
             default:
+                // char literals and wanted one-byte tokens
                 break;
         }
+        lexer->streamIndex = start;
+        Token token = getNextToken(lexer);
+        if(token.type == Token_CodeEnd || (mask & TOKEN_BIT(token.type))) return token;
+        index = lexer->streamIndex;
+    }
+    lexer->streamIndex = length;
+    return createToken(Token_CodeEnd, length, 0);
+}
+//Skim Mode
+
+//Token Stream Functions
+bool initTokenStream(TokenStream* stream, const char* source, int sourceLength){
+    // Typical sources average well over four bytes per token, so this is
+    // the only allocation; growTokenStream jumps straight to the hard bound.
+    int capacity = sourceLength / 4 + 64;
+    stream->source = source;
+    stream->count = 0;
+    stream->capacity = 0;
+    stream->maxTokens = sourceLength + 1;
+    stream->sourceLength = sourceLength;
+    stream->block = NULL;
+    stream->symbolTable = NULL;
+    if(capacity > stream->maxTokens) capacity = stream->maxTokens;
+    return growTokenStream(stream, capacity);
+}
+
+bool growTokenStream(TokenStream* stream, int capacity){
+    size_t n = (size_t)capacity;
+    char* block = malloc(n * (sizeof(TokenValue) + 3 * sizeof(unsigned char) + 2 * sizeof(int) + sizeof(unsigned int)));
+    if(!block) return false;
+
+    // widest column first so every column stays aligned
+    TokenValue* values = (TokenValue*)block;
+    int* offsets = (int*)(values + n);
+    int* lengths = offsets + n;
+    unsigned int* symbols = (unsigned int*)(lengths + n);
+    unsigned char* types = (unsigned char*)(symbols + n);
+    unsigned char* diagnostics = types + n;
+    unsigned char* flags = diagnostics + n;
+
+    if(stream->count > 0){
+        memcpy(offsets, stream->offsets, stream->count * sizeof(int));
+        memcpy(lengths, stream->lengths, stream->count * sizeof(int));
+        memcpy(symbols, stream->symbols, stream->count * sizeof(unsigned int));
+        memcpy(values, stream->values, stream->count * sizeof(TokenValue));
+        memcpy(types, stream->types, stream->count);
+        memcpy(diagnostics, stream->diagnostics, stream->count);
+        memcpy(flags, stream->flags, stream->count);
+    }
+    free(stream->block);
+    stream->block = block;
+    stream->offsets = offsets;
+    stream->lengths = lengths;
+    stream->symbols = symbols;
+    stream->values = values;
+    stream->types = types;
+    stream->diagnostics = diagnostics;
+    stream->flags = flags;
+    stream->capacity = capacity;
+    return true;
+}
+
+bool appendToken(TokenStream* stream, Token token){
+    if(stream->count == stream->capacity){
+        int capacity = stream->maxTokens > stream->capacity ? stream->maxTokens : stream->capacity * 2;
+        if(!growTokenStream(stream, capacity)) return false;
     }
+    int i = stream->count++;
+    stream->types[i] = token.type;
+    stream->diagnostics[i] = token.diagnostic;
+    stream->flags[i] = token.flags;
+    stream->offsets[i] = token.offset;
+    stream->lengths[i] = token.length;
+    stream->symbols[i] = token.symbol;
+    stream->values[i] = token.value;
+    return true;
+}
 
+Token getToken(const TokenStream* stream, int index){
+    Token token;
+    token.type = stream->types[index];
+    token.diagnostic = stream->diagnostics[index];
+    token.flags = stream->flags[index];
+    token.offset = stream->offsets[index];
+    token.length = stream->lengths[index];
+    token.symbol = stream->symbols[index];
+    token.value = stream->values[index];
     return token;
-}
\ No newline at end of file
+}
+
+void freeTokenStream(TokenStream* stream){
+    free(stream->block);
+    stream->block = NULL;
+    stream->count = 0;
+    stream->capacity = 0;
+}
+
+// Lexes the rest of lexer's input into stream, ending with Token_CodeEnd
+bool tokenizeLexer(Lexer* lexer, TokenStream* stream){
+    if(!initTokenStream(stream, lexer->inputStream, lexer->streamLength)) return false;
+    stream->symbolTable = lexer->symbols;
+
+    LEXER_STATS_FILE_BEGIN(fileStart);
+    Token token;
+    do{
+        token = getNextToken(lexer);
+        if(!appendToken(stream, token)) return false;
+    }while(token.type != Token_CodeEnd);
+    LEXER_STATS_FILE_END(fileStart, lexer->streamLength);
+    return true;
+}
+
+bool tokenizeSource(const char* source, int sourceLength, TokenStream* stream){
+    Lexer lexer;
+    initLexer(&lexer, source, sourceLength);
+    return tokenizeLexer(&lexer, stream);
+}
+
+// Lexeme text of a token; not NUL-terminated, use token.length
+const char* tokenText(const char* source, Token token){
+    return source + token.offset;
+}
+
+// Source span of a token, including the quotes around string and char
+// literal bodies
+int tokenSpanStart(Token token){
+    if(token.type == Token_String || token.type == Token_Character) return token.offset - 1;
+    return token.offset;
+}
+int tokenSpanEnd(Token token){
+    if(token.type == Token_String || token.type == Token_Character) return token.offset + token.length + 1;
+    return token.offset + token.length;
+}
+//Token Stream Functions
+
+//Line Index
+// Maps byte offsets to 1-based line/column on demand. Nothing is built
+// until the first lookup: the vectorized newline count sizes the table in
+// one pass, a memchr walk fills in line starts, and every later lookup is
+// a binary search, or a short forward step from the previous answer when
+// lookups come in source order. Columns count bytes, not characters. The
+// index borrows the source; rebuild it after the source changes.
+typedef struct {
+    const char* source;
+    int length;
+    int* starts;    // offset of the first byte of each line
+    int count;      // lines in starts; 0 until built
+    int last;       // line index of the previous lookup
+} LineIndex;
+
+void initLineIndex(LineIndex* index, const char* source, int length){
+    index->source = source;
+    index->length = length;
+    index->starts = NULL;
+    index->count = 0;
+    index->last = 0;
+}
+
+void freeLineIndex(LineIndex* index){
+    free(index->starts);
+    index->starts = NULL;
+    index->count = 0;
+    index->last = 0;
+}
+
+static bool buildLineIndex(LineIndex* index){
+    int lines = scanners.countNewlines(index->source, 0, index->length) + 1;
+    int* starts = malloc(lines * sizeof(int));
+    if(!starts) return false;
+
+    starts[0] = 0;
+    const char* at = index->source;
+    const char* end = index->source + index->length;
+    for(int line = 1; line < lines; line++){
+        at = (const char*)memchr(at, '\n', end - at) + 1;
+        starts[line] = (int)(at - index->source);
+    }
+    index->starts = starts;
+    index->count = lines;
+    return true;
+}
+
+// Line and column of a byte offset; false if the offset is outside the
+// source or the index could not be built
+bool resolvePosition(LineIndex* index, int offset, int* line, int* column){
+    if(offset < 0 || offset > index->length) return false;
+    if(index->count == 0 && !buildLineIndex(index)) return false;
+
+    // last line starting at or before offset
+    int low = index->last;
+    int high = index->count - 1;
+    int steps = 0;
+    if(index->starts[low] > offset) low = 0;
+    while(steps < 8 && low < high && index->starts[low + 1] <= offset){
+        low++;
+        steps++;
+    }
+    if(steps == 8){
+        while(low < high){
+            int mid = low + (high - low + 1) / 2;
+            if(index->starts[mid] <= offset) low = mid;
+            else high = mid - 1;
+        }
+    }
+    index->last = low;
+    *line = low + 1;
+    if(column) *column = offset - index->starts[low] + 1;
+    return true;
+}
+
+// Position of the first byte of a token's source span
+bool resolveTokenPosition(LineIndex* index, Token token, int* line, int* column){
+    return resolvePosition(index, tokenSpanStart(token), line, column);
+}
+//Line Index
+
+//Incremental Re-lexing
+// An edit to the source a TokenStream was lexed from. The new source
+// passed to relexEdit() already has the edit applied.
+typedef struct {
+    int offset;
+    int deletedLength;
+    int insertedLength;
+} LexerEdit;
+
+// Index of the first token whose span ends at or after offset
+static int firstTokenEndingAfter(const TokenStream* stream, int offset){
+    int low = 0, high = stream->count;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(tokenSpanEnd(getToken(stream, mid)) < offset) low = mid + 1;
+        else high = mid;
+    }
+    return low;
+}
+
+// Index in [low, count) of the token whose span starts at spanStart, or -1
+static int findTokenStartingAt(const TokenStream* stream, int low, int spanStart){
+    int high = stream->count;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(tokenSpanStart(getToken(stream, mid)) < spanStart) low = mid + 1;
+        else high = mid;
+    }
+    if(low < stream->count && tokenSpanStart(getToken(stream, low)) == spanStart) return low;
+    return -1;
+}
+
+// Updates stream in place after an edit. Lexing restarts after the last
+// token the edit cannot have touched (its lookahead byte included) and
+// stops at the first new token that starts where an old token started,
+// past the edit: from there the bytes and the STATE_START entry are the
+// same, so the old tokens are reused with shifted offsets. Any LineIndex
+// over the old source is stale afterwards.
+bool relexEdit(TokenStream* stream, const char* newSource, int newLength, const LexerEdit* edit){
+    int delta = edit->insertedLength - edit->deletedLength;
+    int oldCount = stream->count;
+    int k = firstTokenEndingAfter(stream, edit->offset);
+    // an edit past a NUL byte lands after Token_CodeEnd, which is always
+    // relexed so the stream keeps exactly one
+    if(k > oldCount - 1) k = oldCount - 1;
+
+    int restart = k > 0 ? tokenSpanEnd(getToken(stream, k - 1)) : 0;
+
+    Lexer lexer;
+    initLexer(&lexer, newSource, newLength);
+    lexer.streamIndex = restart;
+    lexer.symbols = stream->symbolTable;
+
+    Token* fresh = NULL;
+    int freshCount = 0, freshCapacity = 0;
+    int rejoin = -1;
+    for(;;){
+        Token token = getNextToken(&lexer);
+        int spanStart = tokenSpanStart(token);
+        if(spanStart >= edit->offset + edit->insertedLength){
+            int j = findTokenStartingAt(stream, k, spanStart - delta);
+            if(j >= 0 && tokenSpanStart(getToken(stream, j)) >= edit->offset + edit->deletedLength){
+                rejoin = j;
+                break;
+            }
+        }
+        if(freshCount == freshCapacity){
+            freshCapacity = freshCapacity ? freshCapacity * 2 : 16;
+            Token* grown = realloc(fresh, freshCapacity * sizeof(Token));
+            if(!grown){
+                free(fresh);
+                return false;
+            }
+            fresh = grown;
+        }
+        fresh[freshCount++] = token;
+        if(token.type == Token_CodeEnd) break;
+    }
+
+    int tail = rejoin >= 0 ? oldCount - rejoin : 0;
+    int newCount = k + freshCount + tail;
+    stream->maxTokens = newLength + 1;
+    stream->sourceLength = newLength;
+    if(newCount > stream->capacity && !growTokenStream(stream, newCount)){
+        free(fresh);
+        return false;
+    }
+
+    int to = k + freshCount;
+    if(tail > 0 && to != rejoin){
+        memmove(stream->types + to, stream->types + rejoin, tail);
+        memmove(stream->diagnostics + to, stream->diagnostics + rejoin, tail);
+        memmove(stream->flags + to, stream->flags + rejoin, tail);
+        memmove(stream->offsets + to, stream->offsets + rejoin, tail * sizeof(int));
+        memmove(stream->lengths + to, stream->lengths + rejoin, tail * sizeof(int));
+        memmove(stream->symbols + to, stream->symbols + rejoin, tail * sizeof(unsigned int));
+        memmove(stream->values + to, stream->values + rejoin, tail * sizeof(TokenValue));
+    }
+    for(int i = to; i < to + tail; i++) stream->offsets[i] += delta;
+    stream->count = k;
+    for(int i = 0; i < freshCount; i++) appendToken(stream, fresh[i]);
+    stream->count = newCount;
+    stream->source = newSource;
+    free(fresh);
+    return true;
+}
+//Incremental Re-lexing
+
+//Source File Input
+// Regular files are mapped read-only; pipes, stdin and anything mmap
+// refuses are read into one growing heap buffer. Either way the lexer
+// works straight off the buffer with no per-byte library calls.
+typedef struct {
+    const char* data;
+    int length;
+    bool mapped;
+} SourceFile;
+
+static bool readSourceFd(int fd, SourceFile* file){
+    size_t capacity = 1 << 16;
+    size_t length = 0;
+    char* buffer = malloc(capacity);
+    if(!buffer) return false;
+
+    for(;;){
+        if(length == capacity){
+            if(capacity >= INT_MAX) { free(buffer); return false; }
+            capacity *= 2;
+            char* grown = realloc(buffer, capacity);
+            if(!grown) { free(buffer); return false; }
+            buffer = grown;
+        }
+        ssize_t n = read(fd, buffer + length, capacity - length);
+        if(n == 0) break;
+        if(n < 0){
+            if(errno == EINTR) continue;
+            free(buffer);
+            return false;
+        }
+        length += (size_t)n;
+    }
+    if(length > INT_MAX) { free(buffer); return false; }
+    file->data = buffer;
+    file->length = (int)length;
+    file->mapped = false;
+    return true;
+}
+
+// path "-" reads stdin
+bool openSourceFile(const char* path, SourceFile* file){
+    file->data = NULL;
+    file->length = 0;
+    file->mapped = false;
+
+    if(strcmp(path, "-") == 0) return readSourceFd(STDIN_FILENO, file);
+
+    int fd = open(path, O_RDONLY);
+    if(fd < 0) return false;
+
+    struct stat info;
+    bool ok = false;
+    if(fstat(fd, &info) == 0 && S_ISREG(info.st_mode) && info.st_size > 0){
+        if(info.st_size > INT_MAX){
+            close(fd);
+            return false;
+        }
+        void* map = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(map != MAP_FAILED){
+            madvise(map, (size_t)info.st_size, MADV_SEQUENTIAL);
+            file->data = map;
+            file->length = (int)info.st_size;
+            file->mapped = true;
+            ok = true;
+        }
+    }
+    if(!ok) ok = readSourceFd(fd, file);
+    close(fd);
+    return ok;
+}
+
+void closeSourceFile(SourceFile* file){
+    if(file->mapped) munmap((void*)file->data, (size_t)file->length);
+    else free((void*)file->data);
+    file->data = NULL;
+    file->length = 0;
+    file->mapped = false;
+}
+//Source File Input
+
+//Read-Ahead Input
+// Overlaps disk reads with lexing over a set of files. Up to depth files
+// are in flight at once, each read whole into one of depth reusable
+// buffers through io_uring, and the caller takes them back in the order
+// their reads complete. Without io_uring (old kernel, seccomp, non-Linux),
+// or for stdin, pipes and files over READ_AHEAD_MAX_BYTES, a file is
+// opened with openSourceFile() when it is taken, which is the plain
+// blocking path. One ReadAhead belongs to one thread.
+#define READ_AHEAD_MAX_BYTES (64 << 20)  // larger files are mapped instead
+#define READ_AHEAD_MAX_FILES 16          // cap on the driver's --read-ahead
+
+#if defined(__linux__)
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+#if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#define READ_AHEAD_URING 1
+#endif
+#endif
+
+typedef enum {
+    Read_Free,
+    Read_Pending,   // read submitted to the ring
+    Read_Deferred,  // opened the blocking way when taken
+    Read_Ready,     // read finished, or failed with error
+    Read_Taken      // handed to the caller
+} Read_State;
+
+typedef struct {
+    Read_State state;
+    int tag;            // caller's id for the file
+    const char* path;   // owned by the caller
+    int fd;
+    int length;         // bytes to read
+    int filled;         // bytes read so far
+    int error;          // errno of a failed open or read
+    char* buffer;       // reused from file to file
+    size_t capacity;
+    SourceFile source;  // opened for Read_Deferred
+    bool ownsSource;
+} ReadSlot;
+
+typedef struct {
+    ReadSlot* slots;
+    int depth;
+    int inUse;
+    int ring;  // io_uring fd, -1 for blocking reads
+#ifdef READ_AHEAD_URING
+    void* sqMap;
+    size_t sqMapSize;
+    void* cqMap;
+    size_t cqMapSize;
+    struct io_uring_sqe* sqes;
+    size_t sqesSize;
+    unsigned* sqTail;
+    unsigned* sqMask;
+    unsigned* sqArray;
+    unsigned* cqHead;
+    unsigned* cqTail;
+    unsigned* cqMask;
+    struct io_uring_cqe* cqes;
+#endif
+} ReadAhead;
+
+#ifdef READ_AHEAD_URING
+static int ioUringEnter(int ring, unsigned submit, unsigned wait, unsigned flags){
+    return (int)syscall(__NR_io_uring_enter, ring, submit, wait, flags, NULL, 0);
+}
+
+static bool openReadRing(ReadAhead* ahead){
+    struct io_uring_params params;
+    memset(&params, 0, sizeof(params));
+    int ring = (int)syscall(__NR_io_uring_setup, (unsigned)ahead->depth, &params);
+    if(ring < 0) return false;
+
+    ahead->sqMapSize = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    ahead->cqMapSize = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+    bool single = params.features & IORING_FEAT_SINGLE_MMAP;
+    if(single && ahead->cqMapSize > ahead->sqMapSize) ahead->sqMapSize = ahead->cqMapSize;
+    ahead->sqesSize = params.sq_entries * sizeof(struct io_uring_sqe);
+
+    ahead->sqMap = mmap(NULL, ahead->sqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQ_RING);
+    ahead->cqMap = MAP_FAILED;
+    ahead->sqes = MAP_FAILED;
+    if(ahead->sqMap != MAP_FAILED){
+        ahead->cqMap = single ? ahead->sqMap
+                              : mmap(NULL, ahead->cqMapSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_CQ_RING);
+        ahead->sqes = mmap(NULL, ahead->sqesSize, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring, IORING_OFF_SQES);
+    }
+    if(ahead->sqMap == MAP_FAILED || ahead->cqMap == MAP_FAILED || ahead->sqes == MAP_FAILED){
+        if(ahead->sqes != MAP_FAILED) munmap(ahead->sqes, ahead->sqesSize);
+        if(ahead->cqMap != MAP_FAILED && !single) munmap(ahead->cqMap, ahead->cqMapSize);
+        if(ahead->sqMap != MAP_FAILED) munmap(ahead->sqMap, ahead->sqMapSize);
+        close(ring);
+        return false;
+    }
+    if(single) ahead->cqMapSize = 0;
+
+    char* sq = ahead->sqMap;
+    char* cq = ahead->cqMap;
+    ahead->sqTail = (unsigned*)(sq + params.sq_off.tail);
+    ahead->sqMask = (unsigned*)(sq + params.sq_off.ring_mask);
+    ahead->sqArray = (unsigned*)(sq + params.sq_off.array);
+    ahead->cqHead = (unsigned*)(cq + params.cq_off.head);
+    ahead->cqTail = (unsigned*)(cq + params.cq_off.tail);
+    ahead->cqMask = (unsigned*)(cq + params.cq_off.ring_mask);
+    ahead->cqes = (struct io_uring_cqe*)(cq + params.cq_off.cqes);
+    ahead->ring = ring;
+    return true;
+}
+
+static void closeReadRing(ReadAhead* ahead){
+    munmap(ahead->sqes, ahead->sqesSize);
+    if(ahead->cqMapSize) munmap(ahead->cqMap, ahead->cqMapSize);
+    munmap(ahead->sqMap, ahead->sqMapSize);
+    close(ahead->ring);
+    ahead->ring = -1;
+}
+
+// Queues a read of the rest of the slot's file; false if the kernel refused
+static bool submitSlotRead(ReadAhead* ahead, int index){
+    ReadSlot* slot = &ahead->slots[index];
+    unsigned tail = *ahead->sqTail;
+    unsigned entry = tail & *ahead->sqMask;
+    struct io_uring_sqe* sqe = &ahead->sqes[entry];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = slot->fd;
+    sqe->addr = (unsigned long long)(uintptr_t)(slot->buffer + slot->filled);
+    sqe->len = (unsigned)(slot->length - slot->filled);
+    sqe->off = (unsigned long long)slot->filled;
+    sqe->user_data = (unsigned long long)index;
+    ahead->sqArray[entry] = entry;
+    __atomic_store_n(ahead->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+    int n;
+    do{
+        n = ioUringEnter(ahead->ring, 1, 0, 0);
+    }while(n < 0 && errno == EINTR);
+    if(n == 1) return true;
+    // not consumed: take the entry back
+    __atomic_store_n(ahead->sqTail, tail, __ATOMIC_RELEASE);
+    return false;
+}
+
+// Applies every completion the ring holds; returns how many there were
+static int reapReads(ReadAhead* ahead){
+    unsigned head = *ahead->cqHead;
+    unsigned tail = __atomic_load_n(ahead->cqTail, __ATOMIC_ACQUIRE);
+    int count = 0;
+    for(; head != tail; head++, count++){
+        struct io_uring_cqe* cqe = &ahead->cqes[head & *ahead->cqMask];
+        int index = (int)cqe->user_data;
+        ReadSlot* slot = &ahead->slots[index];
+        int result = cqe->res;
+        if(result > 0){
+            slot->filled += result;
+            // a short read: ask for the rest
+            if(slot->filled < slot->length && submitSlotRead(ahead, index)) continue;
+            if(slot->filled < slot->length) slot->error = EIO;
+        }
+        else if(result == -EINTR || result == -EAGAIN){
+            if(submitSlotRead(ahead, index)) continue;
+            slot->error = EIO;
+        }
+        else if(result == -EINVAL || result == -EOPNOTSUPP){
+            // kernel without IORING_OP_READ: read this file the blocking way
+            close(slot->fd);
+            slot->state = Read_Deferred;
+            continue;
+        }
+        else if(result < 0){
+            slot->error = -result;
+        }
+        // 0 means the file shrank after fstat; keep what was read
+        close(slot->fd);
+        slot->length = slot->filled;
+        slot->state = Read_Ready;
+    }
+    __atomic_store_n(ahead->cqHead, head, __ATOMIC_RELEASE);
+    return count;
+}
+#endif
+
+// depth files in flight at most; with useRing false, or if io_uring is
+// unavailable, every file takes the blocking path
+bool initReadAhead(ReadAhead* ahead, int depth, bool useRing){
+    ahead->slots = calloc((size_t)depth, sizeof(ReadSlot));
+    if(!ahead->slots) return false;
+    ahead->depth = depth;
+    ahead->inUse = 0;
+    ahead->ring = -1;
+#ifdef READ_AHEAD_URING
+    if(useRing) openReadRing(ahead);
+#else
+    (void)useRing;
+#endif
+    return true;
+}
+
+void freeReadAhead(ReadAhead* ahead){
+    for(int i = 0; i < ahead->depth; i++) free(ahead->slots[i].buffer);
+    free(ahead->slots);
+    ahead->slots = NULL;
+#ifdef READ_AHEAD_URING
+    if(ahead->ring >= 0) closeReadRing(ahead);
+#endif
+}
+
+bool readAheadFull(const ReadAhead* ahead){
+    return ahead->inUse == ahead->depth;
+}
+
+bool readAheadEmpty(const ReadAhead* ahead){
+    return ahead->inUse == 0;
+}
+
+// Starts reading path, which must stay valid until the file is released;
+// tag comes back from nextReadAhead(). Call only when !readAheadFull().
+void submitReadAhead(ReadAhead* ahead, const char* path, int tag){
+    int index = 0;
+    while(ahead->slots[index].state != Read_Free) index++;
+    ReadSlot* slot = &ahead->slots[index];
+    slot->tag = tag;
+    slot->path = path;
+    slot->filled = 0;
+    slot->error = 0;
+    slot->state = Read_Deferred;
+    ahead->inUse++;
+#ifdef READ_AHEAD_URING
+    if(ahead->ring < 0 || strcmp(path, "-") == 0) return;
+    slot->fd = open(path, O_RDONLY);
+    if(slot->fd < 0){
+        slot->error = errno;
+        slot->state = Read_Ready;
+        return;
+    }
+    struct stat info;
+    if(fstat(slot->fd, &info) != 0 || !S_ISREG(info.st_mode) || info.st_size == 0 || info.st_size > READ_AHEAD_MAX_BYTES){
+        close(slot->fd);
+        return;
+    }
+    slot->length = (int)info.st_size;
+    if((size_t)slot->length > slot->capacity){
+        char* buffer = malloc((size_t)slot->length);
+        if(!buffer){
+            close(slot->fd);
+            return;
+        }
+        free(slot->buffer);
+        slot->buffer = buffer;
+        slot->capacity = (size_t)slot->length;
+    }
+    slot->state = Read_Pending;
+    if(!submitSlotRead(ahead, index)){
+        close(slot->fd);
+        slot->state = Read_Deferred;
+    }
+#endif
+}
+
+// Waits for the next file to be ready and returns its slot, to be handed
+// to releaseReadAhead() once the caller is done with *source; -1 when
+// nothing is in flight. A file that could not be read comes back with
+// *error set and an empty source (data NULL, length 0).
+int nextReadAhead(ReadAhead* ahead, int* tag, SourceFile* source, int* error){
+    for(;;){
+        bool pending = false;
+        for(int i = 0; i < ahead->depth; i++){
+            ReadSlot* slot = &ahead->slots[i];
+            if(slot->state == Read_Pending) pending = true;
+            if(slot->state != Read_Ready && slot->state != Read_Deferred) continue;
+
+            *tag = slot->tag;
+            *error = slot->error;
+            if(slot->state == Read_Deferred){
+                errno = 0;
+                slot->ownsSource = openSourceFile(slot->path, &slot->source);
+                if(!slot->ownsSource) *error = errno ? errno : EIO;
+                *source = slot->source;
+            }
+            else{
+                source->data = slot->buffer;
+                source->length = slot->length;
+                source->mapped = false;
+            }
+            if(*error){
+                // the buffer may still hold the slot's previous file
+                source->data = NULL;
+                source->length = 0;
+                source->mapped = false;
+            }
+            slot->state = Read_Taken;
+            return i;
+        }
+        if(!pending) return -1;
+#ifdef READ_AHEAD_URING
+        if(reapReads(ahead) == 0) ioUringEnter(ahead->ring, 0, 1, IORING_ENTER_GETEVENTS);
+#endif
+    }
+}
+
+void releaseReadAhead(ReadAhead* ahead, int index){
+    ReadSlot* slot = &ahead->slots[index];
+    if(slot->ownsSource) closeSourceFile(&slot->source);
+    slot->ownsSource = false;
+    slot->state = Read_Free;
+    ahead->inUse--;
+}
+//Read-Ahead Input
+
+//Binary Token Format
+// A file's token stream in a form other tools can load without lexing.
+// All integers are little-endian; varints are LEB128.
+//   header   "OLXT", u16 version, u16 flags, u32 tokenCount, u32 sourceLength,
+//            u32 spanBytes, u32 symbolBytes, u32 stringBytes
+//   types    one Token_Type byte per token
+//   spans    per token: zigzag varint gap from the previous token's end,
+//            varint length (doubled, plus TOKEN_HAS_ESCAPES, for literals),
+//            varint diagnostic for Token_Unknown
+//   symbols  with TOKEN_FILE_SYMBOLS: varint symbol ID per identifier
+//   strings  with TOKEN_FILE_SYMBOLS: varint name count, then varint
+//            length and bytes per name, in ID order
+#define TOKEN_FILE_MAGIC "OLXT"
+#define TOKEN_FILE_VERSION 2  // 2: line numbers dropped, tokens carry offsets only
+#define TOKEN_FILE_HEADER_SIZE 28
+#define TOKEN_FILE_SYMBOLS 0x0001  // symbols and string table present
+
+static bool hasLiteralFlags(int type){
+    return type == Token_String || type == Token_Character;
+}
+
+static unsigned char* putVarint(unsigned char* out, unsigned int value){
+    while(value >= 0x80){
+        *out++ = (unsigned char)(value | 0x80);
+        value >>= 7;
+    }
+    *out++ = (unsigned char)value;
+    return out;
+}
+
+static bool getVarint(const unsigned char** in, const unsigned char* end, unsigned int* value){
+    const unsigned char* p = *in;
+    unsigned int result = 0;
+    for(int shift = 0; shift < 35 && p < end; shift += 7){
+        unsigned char byte = *p++;
+        result |= (unsigned int)(byte & 0x7F) << shift;
+        if(!(byte & 0x80)){
+            *value = result;
+            *in = p;
+            return true;
+        }
+    }
+    return false;
+}
+
+static void putU16(unsigned char* out, unsigned int value){
+    out[0] = (unsigned char)value;
+    out[1] = (unsigned char)(value >> 8);
+}
+
+static void putU32(unsigned char* out, unsigned int value){
+    for(int i = 0; i < 4; i++) out[i] = (unsigned char)(value >> (8 * i));
+}
+
+static unsigned int getU16(const unsigned char* in){
+    return in[0] | (unsigned int)in[1] << 8;
+}
+
+static unsigned int getU32(const unsigned char* in){
+    return in[0] | (unsigned int)in[1] << 8 | (unsigned int)in[2] << 16 | (unsigned int)in[3] << 24;
+}
+
+// Serialises stream into one malloc'd buffer; the caller frees it
+unsigned char* encodeTokenStream(const TokenStream* stream, size_t* size){
+    const SymbolTable* table = stream->symbolTable;
+    int count = stream->count;
+    size_t bound = TOKEN_FILE_HEADER_SIZE + (size_t)count * 21 + 5;
+    if(table){
+        for(unsigned int id = 1; id <= table->count; id++) bound += 5 + table->lengths[id];
+    }
+    unsigned char* buffer = malloc(bound);
+    if(!buffer) return NULL;
+
+    unsigned char* out = buffer + TOKEN_FILE_HEADER_SIZE;
+    memcpy(out, stream->types, count);
+    out += count;
+
+    unsigned char* spans = out;
+    int previousEnd = 0;
+    for(int i = 0; i < count; i++){
+        int gap = stream->offsets[i] - previousEnd;
+        unsigned int length = stream->lengths[i];
+        out = putVarint(out, ((unsigned int)gap << 1) ^ (unsigned int)(gap >> 31));
+        if(hasLiteralFlags(stream->types[i])) length = length << 1 | (stream->flags[i] & TOKEN_HAS_ESCAPES);
+        out = putVarint(out, length);
+        if(stream->types[i] == Token_Unknown) out = putVarint(out, stream->diagnostics[i]);
+        previousEnd = stream->offsets[i] + stream->lengths[i];
+    }
+
+    unsigned char* symbols = out;
+    unsigned char* strings = out;
+    if(table){
+        for(int i = 0; i < count; i++){
+            if(stream->types[i] == Token_Identifier) out = putVarint(out, stream->symbols[i]);
+        }
+        strings = out;
+        out = putVarint(out, table->count);
+        for(unsigned int id = 1; id <= table->count; id++){
+            out = putVarint(out, (unsigned int)table->lengths[id]);
+            memcpy(out, table->names[id], table->lengths[id]);
+            out += table->lengths[id];
+        }
+    }
+
+    memcpy(buffer, TOKEN_FILE_MAGIC, 4);
+    putU16(buffer + 4, TOKEN_FILE_VERSION);
+    putU16(buffer + 6, table ? TOKEN_FILE_SYMBOLS : 0);
+    putU32(buffer + 8, (unsigned int)count);
+    putU32(buffer + 12, (unsigned int)stream->sourceLength);
+    putU32(buffer + 16, (unsigned int)(symbols - spans));
+    putU32(buffer + 20, (unsigned int)(strings - symbols));
+    putU32(buffer + 24, (unsigned int)(out - strings));
+    *size = (size_t)(out - buffer);
+    return buffer;
+}
+
+// Encodes stream and hands it to the kernel in a single write
+bool writeTokenStream(const TokenStream* stream, int fd){
+    size_t size;
+    unsigned char* buffer = encodeTokenStream(stream, &size);
+    if(!buffer) return false;
+    size_t written = 0;
+    while(written < size){
+        ssize_t n = write(fd, buffer + written, size - written);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        written += (size_t)n;
+    }
+    free(buffer);
+    return written == size;
+}
+
+bool saveTokenStream(const TokenStream* stream, const char* path){
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if(fd < 0) return false;
+    bool ok = writeTokenStream(stream, fd);
+    if(close(fd) != 0) ok = false;
+    return ok;
+}
+
+// A loaded token file; the sections point into the file's bytes
+typedef struct {
+    SourceFile file;
+    int count;
+    int sourceLength;
+    unsigned int flags;
+    const unsigned char* types;
+    const unsigned char* spans;
+    const unsigned char* symbols;
+    const unsigned char* strings;
+    const unsigned char* end;
+} TokenFile;
+
+// Checks the header and locates the sections of an in-memory token file
+bool initTokenFile(TokenFile* tokens, const unsigned char* data, size_t size){
+    if(size < TOKEN_FILE_HEADER_SIZE || memcmp(data, TOKEN_FILE_MAGIC, 4) != 0) return false;
+    if(getU16(data + 4) != TOKEN_FILE_VERSION) return false;
+    unsigned long long count = getU32(data + 8);
+    unsigned long long total = TOKEN_FILE_HEADER_SIZE + count + getU32(data + 16)
+                             + (unsigned long long)getU32(data + 20) + getU32(data + 24);
+    if(total != size || count > INT_MAX || getU32(data + 12) > INT_MAX) return false;
+
+    tokens->count = (int)count;
+    tokens->sourceLength = (int)getU32(data + 12);
+    tokens->flags = getU16(data + 6);
+    tokens->types = data + TOKEN_FILE_HEADER_SIZE;
+    tokens->spans = tokens->types + count;
+    tokens->symbols = tokens->spans + getU32(data + 16);
+    tokens->strings = tokens->symbols + getU32(data + 20);
+    tokens->end = data + size;
+    return true;
+}
+
+// Maps a token file written by saveTokenStream()
+bool openTokenFile(const char* path, TokenFile* tokens){
+    if(!openSourceFile(path, &tokens->file)) return false;
+    if(!initTokenFile(tokens, (const unsigned char*)tokens->file.data, (size_t)tokens->file.length)){
+        closeSourceFile(&tokens->file);
+        return false;
+    }
+    return true;
+}
+
+void closeTokenFile(TokenFile* tokens){
+    closeSourceFile(&tokens->file);
+}
+
+// Walks a token file in order, decoding straight from its bytes
+typedef struct {
+    const TokenFile* tokens;
+    int index;
+    const unsigned char* span;
+    const unsigned char* symbol;
+    int previousEnd;
+} TokenFileCursor;
+
+void initTokenFileCursor(TokenFileCursor* cursor, const TokenFile* tokens){
+    cursor->tokens = tokens;
+    cursor->index = 0;
+    cursor->span = tokens->spans;
+    cursor->symbol = tokens->symbols;
+    cursor->previousEnd = 0;
+}
+
+// False after the last token or on a corrupt file, including any span
+// outside the header's sourceLength. Number values are not stored in the
+// file and come back as 0 without TOKEN_DECIMAL; loadTokenStream restores
+// them.
+bool nextFileToken(TokenFileCursor* cursor, Token* token){
+    const TokenFile* tokens = cursor->tokens;
+    if(cursor->index >= tokens->count) return false;
+
+    unsigned int type = tokens->types[cursor->index];
+    unsigned int gap, length, value;
+    if(type >= TOKEN_TYPE_COUNT) return false;
+    if(!getVarint(&cursor->span, tokens->symbols, &gap)) return false;
+    if(!getVarint(&cursor->span, tokens->symbols, &length)) return false;
+    long long offset = cursor->previousEnd + (long long)(int)((gap >> 1) ^ -(gap & 1));
+    unsigned int flags = 0;
+    if(hasLiteralFlags(type)){
+        flags = length & TOKEN_HAS_ESCAPES;
+        length >>= 1;
+    }
+    // a corrupt or colliding file must not point tokens outside the source
+    if(offset < 0 || length > (unsigned int)tokens->sourceLength || offset > tokens->sourceLength - (long long)length){
+        return false;
+    }
+    *token = createToken((Token_Type)type, (int)offset, (int)length);
+    token->flags = (unsigned char)flags;
+    if(type == Token_Unknown){
+        if(!getVarint(&cursor->span, tokens->symbols, &value)) return false;
+        token->diagnostic = (unsigned char)value;
+    }
+    cursor->previousEnd = token->offset + token->length;
+
+    if(type == Token_Identifier && (tokens->flags & TOKEN_FILE_SYMBOLS)){
+        if(!getVarint(&cursor->symbol, tokens->strings, &token->symbol)) return false;
+    }
+    cursor->index++;
+    return true;
+}
+
+// Interns the string table into an empty table, so IDs match the file's
+bool loadTokenFileSymbols(const TokenFile* tokens, SymbolTable* table){
+    if(!(tokens->flags & TOKEN_FILE_SYMBOLS)) return true;
+    const unsigned char* p = tokens->strings;
+    unsigned int count, length;
+    if(!getVarint(&p, tokens->end, &count)) return false;
+    for(unsigned int id = 1; id <= count; id++){
+        if(!getVarint(&p, tokens->end, &length) || length > (size_t)(tokens->end - p)) return false;
+        if(internSymbol(table, (const char*)p, (int)length) != id) return false;
+        p += length;
+    }
+    return true;
+}
+
+// Rebuilds a TokenStream over source from a token file, converting number
+// literals again. Symbol IDs are copied as stored; point symbolTable at a
+// loadTokenFileSymbols() table.
+bool loadTokenStream(const TokenFile* tokens, const char* source, TokenStream* stream){
+    if(!initTokenStream(stream, source, tokens->sourceLength)) return false;
+    if(tokens->count > stream->capacity && !growTokenStream(stream, tokens->count)) return false;
+    TokenFileCursor cursor;
+    initTokenFileCursor(&cursor, tokens);
+    Token token;
+    while(nextFileToken(&cursor, &token)){
+        if(token.type == Token_Number){
+            int end;
+            if(token.length <= 0) return false;
+            token = lexNumber(source, token.offset, token.offset + token.length, &end);
+            if(end != token.offset + token.length) return false;
+        }
+        if(!appendToken(stream, token)) return false;
+    }
+    return cursor.index == tokens->count;
+}
+//Binary Token Format
+
+//Token Cache
+// On-disk cache of token files in one directory, shared safely between
+// processes. An entry is named after a 128-bit hash of the source and a
+// fingerprint of LEXER_VERSION and keywords[], so any change to either
+// misses instead of returning stale tokens. Entries are written to a temp
+// file and renamed into place; a hit bumps the entry's mtime, and when the
+// directory outgrows its budget the least recently used entries go first.
+// One TokenCache may be shared by threads.
+#define LEXER_VERSION 4                   // bump whenever lexer output changes
+#define TOKEN_CACHE_SUFFIX ".olxt"
+#define TOKEN_CACHE_STALE_TEMP_SECONDS 3600  // temp files a crashed writer left behind
+
+typedef struct {
+    char* directory;
+    long long maxBytes;
+    atomic_llong usedBytes;  // estimate, refreshed from disk when evicting
+    atomic_bool evicting;
+    unsigned long long fingerprint;
+} TokenCache;
+
+static unsigned long long lexerFingerprint(){
+    unsigned long long h = hashBytes("lexer", 5, LEXER_VERSION);
+    for(int i = 0; i < KEYWORD_COUNT; i++){
+        h = hashBytes(keywords[i].word, strlen(keywords[i].word), h);
+        h = hashBytes(&keywords[i].type, sizeof(keywords[i].type), h);
+    }
+    return h;
+}
+
+static void evictTokenCache(TokenCache* cache);
+
+// Creates directory if needed; maxBytes bounds the entries' total size
+bool initTokenCache(TokenCache* cache, const char* directory, long long maxBytes){
+    if(mkdir(directory, 0755) != 0 && errno != EEXIST) return false;
+    cache->directory = strdup(directory);
+    if(!cache->directory) return false;
+    cache->maxBytes = maxBytes;
+    atomic_init(&cache->usedBytes, 0);
+    atomic_init(&cache->evicting, false);
+    cache->fingerprint = lexerFingerprint();
+    evictTokenCache(cache);
+    return true;
+}
+
+void freeTokenCache(TokenCache* cache){
+    free(cache->directory);
+    cache->directory = NULL;
+}
+
+static bool tokenCachePath(const TokenCache* cache, const char* source, int length, char* path, size_t size){
+    unsigned long long low = hashBytes(source, length, cache->fingerprint);
+    unsigned long long high = hashBytes(source, length, ~cache->fingerprint);
+    int n = snprintf(path, size, "%s/%016llx%016llx%s", cache->directory, high, low, TOKEN_CACHE_SUFFIX);
+    return n > 0 && (size_t)n < size;
+}
+
+// Loads the cached stream for source; false on a miss
+bool lookupTokenCache(TokenCache* cache, const char* source, int length, TokenStream* stream){
+    char path[PATH_MAX];
+    if(!tokenCachePath(cache, source, length, path, sizeof(path))) return false;
+    TokenFile tokens;
+    if(!openTokenFile(path, &tokens)) return false;
+    if(tokens.sourceLength != length){
+        closeTokenFile(&tokens);
+        return false;
+    }
+    bool ok = loadTokenStream(&tokens, source, stream);
+    closeTokenFile(&tokens);
+    if(!ok){
+        freeTokenStream(stream);
+        return false;
+    }
+    utimensat(AT_FDCWD, path, NULL, 0);
+    return true;
+}
+
+// Stores stream for source; symbol IDs are not cached
+bool storeTokenCache(TokenCache* cache, const char* source, int length, const TokenStream* stream){
+    char path[PATH_MAX];
+    char temp[PATH_MAX];
+    if(!tokenCachePath(cache, source, length, path, sizeof(path))) return false;
+    if(snprintf(temp, sizeof(temp), "%s/.tmp-XXXXXX", cache->directory) >= (int)sizeof(temp)) return false;
+
+    TokenStream plain = *stream;
+    plain.symbolTable = NULL;
+    size_t size;
+    unsigned char* buffer = encodeTokenStream(&plain, &size);
+    if(!buffer) return false;
+
+    int fd = mkstemp(temp);
+    if(fd < 0){
+        free(buffer);
+        return false;
+    }
+    size_t written = 0;
+    while(written < size){
+        ssize_t n = write(fd, buffer + written, size - written);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        written += (size_t)n;
+    }
+    free(buffer);
+    fchmod(fd, 0644);
+    bool ok = close(fd) == 0 && written == size && rename(temp, path) == 0;
+    if(!ok){
+        unlink(temp);
+        return false;
+    }
+
+    long long used = atomic_fetch_add(&cache->usedBytes, (long long)size) + (long long)size;
+    if(used > cache->maxBytes && !atomic_exchange(&cache->evicting, true)){
+        evictTokenCache(cache);
+        atomic_store(&cache->evicting, false);
+    }
+    return true;
+}
+
+typedef struct {
+    char name[NAME_MAX + 1];
+    long long size;
+    time_t used;
+} TokenCacheEntry;
+
+static int compareCacheEntries(const void* a, const void* b){
+    const TokenCacheEntry* x = a;
+    const TokenCacheEntry* y = b;
+    return (x->used > y->used) - (x->used < y->used);
+}
+
+// Rescans the directory, then drops least recently used entries until the
+// cache is back under three quarters of its budget
+static void evictTokenCache(TokenCache* cache){
+    DIR* dir = opendir(cache->directory);
+    if(!dir) return;
+    int dirFd = dirfd(dir);
+    time_t now = time(NULL);
+    TokenCacheEntry* entries = NULL;
+    int count = 0, capacity = 0;
+    long long total = 0;
+    struct dirent* entry;
+    while((entry = readdir(dir))){
+        struct stat info;
+        if(fstatat(dirFd, entry->d_name, &info, AT_SYMLINK_NOFOLLOW) != 0 || !S_ISREG(info.st_mode)) continue;
+        if(strncmp(entry->d_name, ".tmp-", 5) == 0){
+            if(now - info.st_mtime > TOKEN_CACHE_STALE_TEMP_SECONDS) unlinkat(dirFd, entry->d_name, 0);
+            continue;
+        }
+        size_t nameLength = strlen(entry->d_name);
+        size_t suffixLength = strlen(TOKEN_CACHE_SUFFIX);
+        if(nameLength <= suffixLength || strcmp(entry->d_name + nameLength - suffixLength, TOKEN_CACHE_SUFFIX) != 0) continue;
+
+        if(count == capacity){
+            capacity = capacity ? capacity * 2 : 64;
+            TokenCacheEntry* grown = realloc(entries, capacity * sizeof(TokenCacheEntry));
+            if(!grown) break;
+            entries = grown;
+        }
+        memcpy(entries[count].name, entry->d_name, nameLength + 1);
+        entries[count].size = (long long)info.st_size;
+        entries[count].used = info.st_mtime;
+        total += entries[count].size;
+        count++;
+    }
+
+    if(total > cache->maxBytes){
+        qsort(entries, count, sizeof(TokenCacheEntry), compareCacheEntries);
+        long long target = cache->maxBytes / 4 * 3;
+        for(int i = 0; i < count && total > target; i++){
+            // another process may have evicted it already
+            if(unlinkat(dirFd, entries[i].name, 0) == 0 || errno == ENOENT) total -= entries[i].size;
+        }
+    }
+    atomic_store(&cache->usedBytes, total);
+    free(entries);
+    closedir(dir);
+}
+
+// tokenizeLexer() through the cache: a hit skips the automaton entirely
+// (identifiers are re-interned if the lexer has a symbol table), a miss
+// lexes and stores the result. Only default-mode streams are cached, so
+// a lexer with unicodeIdentifiers always lexes.
+bool tokenizeCached(TokenCache* cache, Lexer* lexer, TokenStream* stream){
+    const char* source = lexer->inputStream;
+    int length = lexer->streamLength;
+    if(lexer->unicodeIdentifiers) return tokenizeLexer(lexer, stream);
+    if(lexer->streamIndex == 0 && lookupTokenCache(cache, source, length, stream)){
+        stream->symbolTable = lexer->symbols;
+        for(int i = 0; i < stream->count; i++){
+            stream->symbols[i] = 0;
+            if(lexer->symbols && stream->types[i] == Token_Identifier){
+                stream->symbols[i] = internSymbol(lexer->symbols, source + stream->offsets[i], stream->lengths[i]);
+            }
+        }
+        lexer->streamIndex = length;
+        return true;
+    }
+    bool whole = lexer->streamIndex == 0;
+    if(!tokenizeLexer(lexer, stream)) return false;
+    if(whole) storeTokenCache(cache, source, length, stream);
+    return true;
+}
+//Token Cache
+
+//Parallel Chunked Lexing
+// Chunks always end just after a newline. Strings, char literals and line
+// comments stop at a newline, so the only state that can cross a chunk
+// boundary is an open ~/ ... /~ block comment. Each chunk is lexed from
+// STATE_START, and every chunk after the first is also lexed speculatively
+// for the entry state "inside a block comment": from just past its first
+// "/~" until that run produces a token the STATE_START run also has. The
+// stitch pass then follows the real entry states, picks the matching run
+// for each chunk and copies the tokens into the output in parallel, so the
+// result is exactly the serial getNextToken() stream.
+#define PARALLEL_CHUNKS_PER_THREAD 4
+#define PARALLEL_MIN_CHUNK (256 * 1024)
+
+typedef struct {
+    bool inComment;     // run ended inside an unclosed block comment
+    int commentOffset;
+} ChunkExit;
+
+typedef struct {
+    int start;
+    int end;
+    TokenStream tokens;     // lexed from STATE_START
+    ChunkExit exit;
+    int closeEnd;           // just past the first "/~", -1 if there is none
+    TokenStream resumed;    // lexed from closeEnd until it rejoins tokens
+    int rejoinIndex;        // first token of tokens shared by resumed, or -1
+    ChunkExit resumedExit;  // exit of resumed when it never rejoins
+    bool ok;
+
+    // stitch plan
+    bool closesComment;     // entered inside a block comment that ends here
+    Token comment;
+    bool useResumed;
+    int tokensFrom;         // first token of tokens to copy, -1 for none
+    int outIndex;
+} LexChunk;
+
+typedef struct {
+    const char* source;
+    TokenStream* out;
+    LexChunk* chunks;
+    int chunkCount;
+    atomic_int next;
+    bool stitching;
+} ParallelLexJob;
+
+// Index of the token whose span starts at spanStart, or -1
+static int findTokenBySpanStart(const TokenStream* stream, int spanStart){
+    int low = 0, high = stream->count;
+    while(low < high){
+        int mid = (low + high) / 2;
+        if(tokenSpanStart(getToken(stream, mid)) < spanStart) low = mid + 1;
+        else high = mid;
+    }
+    if(low < stream->count && tokenSpanStart(getToken(stream, low)) == spanStart) return low;
+    return -1;
+}
+
+// Lexes [from, end) starting in STATE_START. With rejoin set, stops at the
+// first token that rejoin also contains.
+static bool lexChunkRun(const char* source, int from, int end, const TokenStream* rejoin,
+                        TokenStream* out, ChunkExit* exit, int* rejoinIndex){
+    Lexer lexer;
+    initLexer(&lexer, source, end);
+    lexer.streamIndex = from;
+    exit->inComment = false;
+    if(rejoinIndex) *rejoinIndex = -1;
+    if(!initTokenStream(out, source, end - from)) return false;
+    out->sourceLength = end;  // offsets index the whole source
+
+    for(;;){
+        Token token = getNextToken(&lexer);
+        if(token.type == Token_CodeEnd) break;
+        if(token.type == Token_Unknown && token.diagnostic == Diag_Unclosed_Block_Comment){
+            exit->inComment = true;
+            exit->commentOffset = token.offset;
+            break;
+        }
+        if(rejoin){
+            int j = findTokenBySpanStart(rejoin, tokenSpanStart(token));
+            if(j >= 0){
+                *rejoinIndex = j;
+                return true;
+            }
+        }
+        if(!appendToken(out, token)) return false;
+    }
+    return true;
+}
+
+static void lexChunk(const char* source, LexChunk* chunk, bool speculate){
+    chunk->ok = lexChunkRun(source, chunk->start, chunk->end, NULL, &chunk->tokens, &chunk->exit, NULL);
+    chunk->closeEnd = -1;
+    chunk->rejoinIndex = -1;
+    chunk->resumed.block = NULL;
+    chunk->resumed.count = 0;
+    if(!chunk->ok || !speculate) return;
+
+    // entry inside a block comment: the comment runs to the first "/~"
+    int i = chunk->start;
+    while((i = scanners.findAny(source, i, chunk->end, blockCommentStops)) < chunk->end){
+        if(i + 1 < chunk->end && source[i + 1] == '~'){
+            chunk->closeEnd = i + 2;
+            break;
+        }
+        i++;
+    }
+    if(chunk->closeEnd < 0) return;
+    chunk->ok = lexChunkRun(source, chunk->closeEnd, chunk->end, &chunk->tokens,
+                            &chunk->resumed, &chunk->resumedExit, &chunk->rejoinIndex);
+}
+
+static void copyChunkTokens(TokenStream* out, int outIndex, const TokenStream* from, int first, int count){
+    memcpy(out->types + outIndex, from->types + first, count);
+    memcpy(out->diagnostics + outIndex, from->diagnostics + first, count);
+    memcpy(out->flags + outIndex, from->flags + first, count);
+    memcpy(out->offsets + outIndex, from->offsets + first, count * sizeof(int));
+    memcpy(out->lengths + outIndex, from->lengths + first, count * sizeof(int));
+    memcpy(out->symbols + outIndex, from->symbols + first, count * sizeof(unsigned int));
+    memcpy(out->values + outIndex, from->values + first, count * sizeof(TokenValue));
+}
+
+static void stitchChunk(TokenStream* out, LexChunk* chunk){
+    int outIndex = chunk->outIndex;
+    if(chunk->closesComment){
+        out->types[outIndex] = chunk->comment.type;
+        out->diagnostics[outIndex] = chunk->comment.diagnostic;
+        out->flags[outIndex] = chunk->comment.flags;
+        out->offsets[outIndex] = chunk->comment.offset;
+        out->lengths[outIndex] = chunk->comment.length;
+        out->symbols[outIndex] = 0;
+        out->values[outIndex].integer = 0;
+        outIndex++;
+    }
+    if(chunk->useResumed){
+        copyChunkTokens(out, outIndex, &chunk->resumed, 0, chunk->resumed.count);
+        outIndex += chunk->resumed.count;
+    }
+    if(chunk->tokensFrom >= 0){
+        copyChunkTokens(out, outIndex, &chunk->tokens, chunk->tokensFrom, chunk->tokens.count - chunk->tokensFrom);
+    }
+}
+
+static void* parallelLexWorker(void* arg){
+    ParallelLexJob* job = arg;
+    int i;
+    while((i = atomic_fetch_add(&job->next, 1)) < job->chunkCount){
+        if(job->stitching) stitchChunk(job->out, &job->chunks[i]);
+        else lexChunk(job->source, &job->chunks[i], i > 0);
+    }
+    LEXER_STATS_FLUSH();
+    return NULL;
+}
+
+// Without memory for the thread handles the caller does all the work
+static void runParallelLexJob(ParallelLexJob* job, int threadCount){
+    pthread_t* threads = malloc((threadCount - 1) * sizeof(pthread_t));
+    int started = 0;
+    atomic_store(&job->next, 0);
+    for(; threads && started < threadCount - 1; started++){
+        if(pthread_create(&threads[started], NULL, parallelLexWorker, job) != 0) break;
+    }
+    parallelLexWorker(job);
+    for(int t = 0; t < started; t++) pthread_join(threads[t], NULL);
+    free(threads);
+}
+
+// Same result as tokenizeSource(), lexed on up to threadCount threads
+bool tokenizeParallel(const char* source, int sourceLength, int threadCount, TokenStream* stream){
+    // the automaton stops at the first NUL byte
+    const char* nul = memchr(source, '\0', sourceLength);
+    int length = nul ? (int)(nul - source) : sourceLength;
+
+    // a thread that cannot get a whole chunk only adds start-up cost
+    if(threadCount > length / PARALLEL_MIN_CHUNK) threadCount = length / PARALLEL_MIN_CHUNK;
+    if(threadCount < 1) threadCount = 1;
+    int chunkCount = threadCount * PARALLEL_CHUNKS_PER_THREAD;
+    if(chunkCount > length / PARALLEL_MIN_CHUNK) chunkCount = length / PARALLEL_MIN_CHUNK;
+    if(threadCount == 1 || chunkCount < 2) return tokenizeSource(source, length, stream);
+
+    LexChunk* chunks = calloc(chunkCount, sizeof(LexChunk));
+    if(!chunks) return false;
+    LEXER_STATS_FILE_BEGIN(fileStart);
+    int count = 0;
+    int start = 0;
+    for(int i = 1; i <= chunkCount && start < length; i++){
+        int end = length;
+        if(i < chunkCount){
+            const char* newline = memchr(source + (long long)length * i / chunkCount, '\n',
+                                         length - (int)((long long)length * i / chunkCount));
+            if(newline) end = (int)(newline - source) + 1;
+        }
+        if(end <= start) continue;
+        chunks[count].start = start;
+        chunks[count].end = end;
+        count++;
+        start = end;
+    }
+
+    ParallelLexJob job = { source, stream, chunks, count, 0, false };
+    runParallelLexJob(&job, threadCount);
+
+    bool ok = true;
+    for(int i = 0; i < count; i++) ok = ok && chunks[i].ok;
+
+    // plan: follow the real entry state of every chunk
+    ChunkExit state = { false, 0 };
+    int outIndex = 0;
+    for(int i = 0; ok && i < count; i++){
+        LexChunk* chunk = &chunks[i];
+        chunk->outIndex = outIndex;
+        chunk->closesComment = false;
+        chunk->useResumed = false;
+        chunk->tokensFrom = -1;
+        ChunkExit exit = chunk->exit;
+
+        if(!state.inComment){
+            chunk->tokensFrom = 0;
+            outIndex += chunk->tokens.count;
+        }
+        else if(chunk->closeEnd >= 0){
+            chunk->closesComment = true;
+            chunk->comment = createToken(Token_Block_Comment, state.commentOffset,
+                                         chunk->closeEnd - state.commentOffset);
+            chunk->useResumed = true;
+            outIndex += 1 + chunk->resumed.count;
+            if(chunk->rejoinIndex >= 0){
+                chunk->tokensFrom = chunk->rejoinIndex;
+                outIndex += chunk->tokens.count - chunk->rejoinIndex;
+            }
+            else exit = chunk->resumedExit;
+        }
+        else{
+            // the comment swallows the whole chunk
+            exit = state;
+        }
+        state = exit;
+    }
+
+    if(ok){
+        stream->source = source;
+        stream->count = 0;
+        stream->capacity = 0;
+        stream->maxTokens = sourceLength + 1;
+        stream->sourceLength = sourceLength;
+        stream->block = NULL;
+        stream->symbolTable = NULL;
+        ok = growTokenStream(stream, outIndex + 2);
+    }
+    if(ok){
+        job.stitching = true;
+        runParallelLexJob(&job, threadCount);
+        stream->count = outIndex;
+        if(state.inComment){
+            appendToken(stream, createErrorToken(Diag_Unclosed_Block_Comment, state.commentOffset,
+                                                 length - state.commentOffset));
+        }
+        appendToken(stream, createToken(Token_CodeEnd, length, 0));
+    }
+    LEXER_STATS_FILE_END(fileStart, length);
+
+    for(int i = 0; i < count; i++){
+        freeTokenStream(&chunks[i].tokens);
+        freeTokenStream(&chunks[i].resumed);
+    }
+    free(chunks);
+    return ok;
+}
+//Parallel Chunked Lexing
+
+//Streaming Lexer
+// Lexes input of any size from a file descriptor through one fixed-size
+// window, so memory use does not grow with the input. Token offsets are
+// relative to the current window (tokenText(stream->window, token) is
+// valid until the next call); windowBase + offset is the stream position.
+// A token longer than the whole window is finished by a resumable copy of
+// the literal/comment states and comes back with a negative offset,
+// meaning its start has already been recycled (a number that long comes
+// back as Diag_Number_Overflow). streamTokenLine() counts newlines from
+// a cursor that follows the tokens and survives refills, so a full pass
+// counts each byte about once.
+#define STREAM_MIN_WINDOW 64
+
+typedef struct {
+    int fd;
+    char* window;
+    int windowSize;
+    int fill;               // valid bytes in window
+    long long windowBase;   // stream position of window[0]
+    int lineOffset;         // window offset streamTokenLine has counted to
+    long long lineCount;    // newlines in the stream before window[lineOffset]
+    bool atEof;
+    bool failed;            // a read error ended the stream early
+    Lexer lexer;            // cursor over window[0, fill)
+} StreamLexer;
+
+bool initStreamLexer(StreamLexer* stream, int fd, int windowSize){
+    if(windowSize < STREAM_MIN_WINDOW) windowSize = STREAM_MIN_WINDOW;
+    stream->window = malloc(windowSize);
+    if(!stream->window) return false;
+    stream->fd = fd;
+    stream->windowSize = windowSize;
+    stream->fill = 0;
+    stream->windowBase = 0;
+    stream->lineOffset = 0;
+    stream->lineCount = 0;
+    stream->atEof = false;
+    stream->failed = false;
+    initLexer(&stream->lexer, stream->window, 0);
+    return true;
+}
+
+void freeStreamLexer(StreamLexer* stream){
+    free(stream->window);
+    stream->window = NULL;
+}
+
+// Drops window[0, keep), moves the rest to the front and reads more input
+static void refillStream(StreamLexer* stream, int keep){
+    // the line cursor keeps its place, or moves to the new window start
+    if(stream->lineOffset < keep){
+        stream->lineCount += scanners.countNewlines(stream->window, stream->lineOffset, keep);
+        stream->lineOffset = keep;
+    }
+    stream->lineOffset -= keep;
+    memmove(stream->window, stream->window + keep, stream->fill - keep);
+    stream->windowBase += keep;
+    stream->fill -= keep;
+    stream->lexer.streamIndex -= keep;
+    // the last sequence may have been cut at the old fill: validate again
+    // from where lexing resumes
+    stream->lexer.utf8Checked = stream->lexer.streamIndex;
+
+    while(stream->fill < stream->windowSize && !stream->atEof){
+        ssize_t n = read(stream->fd, stream->window + stream->fill, stream->windowSize - stream->fill);
+        if(n > 0){
+            stream->fill += (int)n;
+            break;
+        }
+        if(n < 0 && errno == EINTR) continue;
+        if(n < 0) stream->failed = true;
+        stream->atEof = true;
+    }
+    stream->lexer.streamLength = stream->fill;
+}
+
+// Resumable part of the automaton for tokens that outgrow the window. Runs
+// from index in *state and returns true with *end set once the token is
+// complete, or false when it needs the next window.
+static bool stepLongToken(AutomatonState* state, const char* input, int index, int fill, bool atEof, bool unicode,
+                          int* end, Token_Type* type, Lexer_Diagnostic* diagnostic, bool* escaped){
+    for(;;){
+        char c;
+        if(index < fill) c = input[index];
+        else if(atEof) c = '\0';
+        else return false;
+
+        switch(*state){
+            case STATE_IN_IDENTIFIER:
+                if(isIdentifierChar(c, unicode)){
+                    index++;
+                    break;
+                }
+                // longer than any keyword
+                *type = Token_Identifier;
+                *end = index;
+                return true;
+
+            case STATE_IN_UTF8:
+                // only a run of stray continuation bytes gets this long
+                if(((unsigned char)c & 0xC0) == 0x80){
+                    index++;
+                    break;
+                }
+                *type = Token_Unknown;
+                *end = index;
+                return true;
+
+            case STATE_IN_NUMBER:
+            case STATE_IN_DECIMAL:
+                if(is_digit(c)){
+                    index++;
+                    break;
+                }
+                if(c == '.' && *state == STATE_IN_NUMBER){
+                    index++;
+                    *state = STATE_IN_DECIMAL;
+                    break;
+                }
+                // its first digits went with the window, so it cannot be
+                // converted; report it as out of range
+                *type = Token_Unknown;
+                *diagnostic = Diag_Number_Overflow;
+                *end = index;
+                return true;
+
+            case STATE_IN_TILDE:
+                if(c == '/'){
+                    index++;
+                    *state = STATE_IN_BLOCK_COMMENT;
+                }
+                else{
+                    *state = STATE_IN_SINGLE_LINE_COMMENT;
+                }
+                break;
+
+            case STATE_IN_SINGLE_LINE_COMMENT:
+                if(c == '\n' || c == '\0'){
+                    *type = Token_Single_Line_Comment;
+                    *end = index;
+                    return true;
+                }
+                index = scanners.findAny(input, index, fill, lineCommentStops);
+                break;
+
+            case STATE_IN_BLOCK_COMMENT:
+                if(c == '/'){
+                    index++;
+                    *state = STATE_IN_BLOCK_COMMENT_TILDE;
+                }
+                else if(c == '\0'){
+                    *type = Token_Unknown;
+                    *diagnostic = Diag_Unclosed_Block_Comment;
+                    *end = index;
+                    return true;
+                }
+                else{
+                    index = scanners.findAny(input, index, fill, blockCommentStops);
+                }
+                break;
+
+            case STATE_IN_BLOCK_COMMENT_TILDE:
+                if(c == '~'){
+                    *type = Token_Block_Comment;
+                    *end = index + 1;
+                    return true;
+                }
+                else if(c == '\0'){
+                    *type = Token_Unknown;
+                    *diagnostic = Diag_Unclosed_Block_Comment;
+                    *end = index;
+                    return true;
+                }
+                *state = STATE_IN_BLOCK_COMMENT;
+                break;
+
+            case STATE_IN_STRING:
+                if(c == '\\'){
+                    index++;
+                    *state = STATE_IN_STRING_ESCAPE;
+                }
+                else if(c == '\"'){
+                    *type = Token_String;
+                    *end = index + 1;
+                    return true;
+                }
+                else if(c == '\n' || c == '\0'){
+                    *type = Token_Unknown;
+                    *diagnostic = Diag_Unclosed_String;
+                    *end = index;
+                    return true;
+                }
+                else{
+                    index = scanners.findAny(input, index, fill, stringStops);
+                }
+                break;
+
+            case STATE_IN_STRING_ESCAPE:
+                if(c == 'n' || c == 't' || c == '\"' || c == '\\'){
+                    index++;
+                    *state = STATE_IN_STRING;
+                    *escaped = true;
+                    break;
+                }
+                *type = Token_Unknown;
+                *diagnostic = Diag_Invalid_Escape;
+                *end = index;
+                return true;
+
+            default:
+                // no other state can outgrow the minimum window
+                *type = Token_Unknown;
+                *end = index;
+                return true;
+        }
+    }
+}
+
+// The token starting at window[0] did not fit: rescan it with the
+// resumable states, recycling the window as often as needed
+static Token finishLongToken(StreamLexer* stream){
+    long long tokenStart = stream->windowBase;
+    char first = stream->window[0];
+    bool unicode = stream->lexer.unicodeIdentifiers;
+    AutomatonState state = STATE_IN_IDENTIFIER;
+    if(first == '~') state = STATE_IN_TILDE;
+    else if(first == '\"') state = STATE_IN_STRING;
+    else if(is_digit(first)) state = STATE_IN_NUMBER;
+    else if((unsigned char)first >= 0x80 && !unicode) state = STATE_IN_UTF8;
+
+    int index = 1;
+    int end;
+    Token_Type type = Token_Unknown;
+    Lexer_Diagnostic diagnostic = Diag_None;
+    bool escaped = false;
+    // each window is validated before it is recycled; a lead byte near the
+    // end stays behind so its sequence is checked whole in the next one
+    int checked = 0;
+    bool valid = true;
+    while(!stepLongToken(&state, stream->window, index, stream->fill, stream->atEof, unicode,
+                         &end, &type, &diagnostic, &escaped)){
+        int cut = utf8SequenceStart(stream->window, checked, stream->fill - 1);
+        if((unsigned char)stream->window[cut] < 0xC0) cut = stream->fill;
+        if(valid && scanners.validateUtf8(stream->window, checked, cut) < cut) valid = false;
+        stream->lexer.streamIndex = stream->fill;
+        refillStream(stream, cut);
+        index = stream->lexer.streamIndex;
+        checked = 0;
+    }
+    if(valid && scanners.validateUtf8(stream->window, checked, end) < end) valid = false;
+    stream->lexer.streamIndex = end;
+    stream->lexer.utf8Checked = end;
+
+    int offset = (int)(tokenStart - stream->windowBase);
+    int length = (int)(stream->windowBase + end - tokenStart);
+    if(!valid) return createErrorToken(Diag_Invalid_Utf8, offset, length);
+    if(type == Token_String){
+        Token token = createToken(type, offset + 1, length - 2);
+        if(escaped) token.flags = TOKEN_HAS_ESCAPES;
+        return token;
+    }
+    if(type == Token_Unknown) return createErrorToken(diagnostic, offset, length);
+    return createToken(type, offset, length);
+}
+
+Token getNextStreamToken(StreamLexer* stream){
+    Lexer* lexer = &stream->lexer;
+    for(;;){
+        Token token = getNextToken(lexer);
+        // a token that stopped short of the window end saw its deciding byte
+        if(lexer->streamIndex < stream->fill || stream->atEof) return token;
+
+        // otherwise it may continue in the next window: relex it from its start
+        int keep = lexer->streamIndex;
+        if(token.type != Token_CodeEnd) keep = tokenSpanStart(token);
+        lexer->streamIndex = keep;
+        if(keep == 0 && stream->fill == stream->windowSize) return finishLongToken(stream);
+        refillStream(stream, keep);
+    }
+}
+
+// 1-based line of a token from the last getNextStreamToken call. Tokens
+// with a negative offset started in a recycled window and report the
+// line of the current window start instead.
+long long streamTokenLine(StreamLexer* stream, Token token){
+    int start = tokenSpanStart(token);
+    if(start < 0) start = 0;
+    // tokens come in order, so the cursor only moves a token ahead
+    if(start >= stream->lineOffset) stream->lineCount += scanners.countNewlines(stream->window, stream->lineOffset, start);
+    else stream->lineCount -= scanners.countNewlines(stream->window, start, stream->lineOffset);
+    stream->lineOffset = start;
+    return stream->lineCount + 1;
+}
+//Streaming Lexer
+
+//Token Pipeline
+// Runs the lexer on its own thread so a consumer (a parser) overlaps with
+// it instead of paying for it token by token. The lexer fills batches of
+// PIPELINE_BATCH tokens in a single-producer/single-consumer ring and
+// publishes each one with a release store; the consumer hands the slot
+// back the same way. No locks: a full ring makes the lexer wait
+// (backpressure), an empty one makes the consumer wait, each spinning
+// briefly and then yielding. The stream ends with Token_CodeEnd.
+// With lexer->symbols set, the lexer thread interns into that table while
+// it runs, and the table is not locked: the consumer must not call
+// symbolName() or internSymbol() on it until Token_CodeEnd has been
+// delivered or stopTokenPipeline() has returned.
+#define PIPELINE_BATCH 256
+#define PIPELINE_SLOTS 32  // power of two
+
+typedef struct {
+    int count;
+    Token tokens[PIPELINE_BATCH];
+} TokenBatch;
+
+typedef struct {
+    TokenBatch* ring;
+    _Alignas(64) atomic_uint head;  // batches published by the lexer
+    _Alignas(64) atomic_uint tail;  // batches released by the consumer
+    atomic_bool stop;
+    _Alignas(64) Lexer lexer;       // owned by the lexer thread
+    pthread_t thread;
+    // consumer side
+    unsigned int consumed;
+    unsigned int knownHead;
+    TokenBatch* current;
+    const Token* batch;
+    int batchCount;
+    int index;
+    bool finished;
+    Token end;
+} TokenPipeline;
+
+static void pipelinePause(int* spins){
+    if(++*spins < 64){
+#if defined(__x86_64__)
+        _mm_pause();
+#endif
+    }
+    else{
+        sched_yield();
+    }
+}
+
+static void* pipelineLexer(void* arg){
+    TokenPipeline* pipeline = arg;
+    unsigned int head = 0;
+    unsigned int tail = 0;
+    for(;;){
+        int spins = 0;
+        while(head - tail == PIPELINE_SLOTS){
+            if(atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) return NULL;
+            tail = atomic_load_explicit(&pipeline->tail, memory_order_acquire);
+            if(head - tail == PIPELINE_SLOTS) pipelinePause(&spins);
+        }
+        if(atomic_load_explicit(&pipeline->stop, memory_order_relaxed)) return NULL;
+
+        TokenBatch* batch = &pipeline->ring[head % PIPELINE_SLOTS];
+        int count = 0;
+        bool end = false;
+        while(count < PIPELINE_BATCH && !end){
+            Token token = getNextToken(&pipeline->lexer);
+            batch->tokens[count++] = token;
+            end = token.type == Token_CodeEnd;
+        }
+        batch->count = count;
+        atomic_store_explicit(&pipeline->head, ++head, memory_order_release);
+        if(end) return NULL;
+    }
+}
+
+// Starts lexing a copy of lexer on a new thread; false if the thread or
+// ring could not be created, in which case lex directly instead. The copy
+// shares lexer->symbols, which belongs to the lexer thread until the end
+// (see above).
+bool startTokenPipeline(TokenPipeline* pipeline, const Lexer* lexer){
+    pipeline->ring = malloc(PIPELINE_SLOTS * sizeof(TokenBatch));
+    if(!pipeline->ring) return false;
+    atomic_init(&pipeline->head, 0);
+    atomic_init(&pipeline->tail, 0);
+    atomic_init(&pipeline->stop, false);
+    pipeline->lexer = *lexer;
+    pipeline->consumed = 0;
+    pipeline->knownHead = 0;
+    pipeline->current = NULL;
+    pipeline->batch = NULL;
+    pipeline->batchCount = 0;
+    pipeline->index = 0;
+    pipeline->finished = false;
+    if(pthread_create(&pipeline->thread, NULL, pipelineLexer, pipeline) != 0){
+        free(pipeline->ring);
+        pipeline->ring = NULL;
+        return false;
+    }
+    return true;
+}
+
+// Next published batch, valid until the following call, which hands its
+// slot back to the lexer. Returns 0 once Token_CodeEnd has been delivered.
+int nextPipelineBatch(TokenPipeline* pipeline, const Token** tokens){
+    if(pipeline->current){
+        atomic_store_explicit(&pipeline->tail, ++pipeline->consumed, memory_order_release);
+        pipeline->current = NULL;
+    }
+    if(pipeline->finished) return 0;
+
+    int spins = 0;
+    while(pipeline->knownHead == pipeline->consumed){
+        pipeline->knownHead = atomic_load_explicit(&pipeline->head, memory_order_acquire);
+        if(pipeline->knownHead == pipeline->consumed) pipelinePause(&spins);
+    }
+    TokenBatch* batch = &pipeline->ring[pipeline->consumed % PIPELINE_SLOTS];
+    pipeline->current = batch;
+    pipeline->finished = batch->tokens[batch->count - 1].type == Token_CodeEnd;
+    *tokens = batch->tokens;
+    return batch->count;
+}
+
+// One token at a time over nextPipelineBatch(); repeats Token_CodeEnd at the end
+Token nextPipelineToken(TokenPipeline* pipeline){
+    if(pipeline->index == pipeline->batchCount){
+        int count = nextPipelineBatch(pipeline, &pipeline->batch);
+        if(count == 0) return pipeline->end;
+        pipeline->batchCount = count;
+        pipeline->index = 0;
+    }
+    Token token = pipeline->batch[pipeline->index++];
+    if(token.type == Token_CodeEnd) pipeline->end = token;
+    return token;
+}
+
+// Joins the lexer thread; safe to call before the end of the stream
+void stopTokenPipeline(TokenPipeline* pipeline){
+    atomic_store(&pipeline->stop, true);
+    pthread_join(pipeline->thread, NULL);
+    free(pipeline->ring);
+    pipeline->ring = NULL;
+}
+//Token Pipeline
+
+//Token Lookahead
+// k-token lookahead and backtracking for a recursive-descent parser. The
+// last LOOKAHEAD_SIZE tokens the lexer produced stay in a ring, so
+// peekToken() lexes only as far ahead as asked and resetLookahead() goes
+// back to a mark without lexing anything again. Positions count tokens
+// from the start of the input. A mark stays valid until the parser has
+// looked more than LOOKAHEAD_SIZE tokens past it.
+#define LOOKAHEAD_SIZE 256  // power of two
+
+typedef struct {
+    Lexer* lexer;
+    int position;  // next token advanceToken() returns
+    int lexed;     // tokens taken from the lexer so far
+    bool ended;    // the last one was Token_CodeEnd
+    Token ring[LOOKAHEAD_SIZE];
+} TokenLookahead;
+
+void initTokenLookahead(TokenLookahead* lookahead, Lexer* lexer){
+    lookahead->lexer = lexer;
+    lookahead->position = 0;
+    lookahead->lexed = 0;
+    lookahead->ended = false;
+}
+
+// Token k places ahead, 0 being the next one; k < LOOKAHEAD_SIZE. Past the
+// end, Token_CodeEnd repeats.
+Token peekToken(TokenLookahead* lookahead, int k){
+    int target = lookahead->position + k;
+    while(lookahead->lexed <= target && !lookahead->ended){
+        Token token = getNextToken(lookahead->lexer);
+        lookahead->ring[lookahead->lexed++ & (LOOKAHEAD_SIZE - 1)] = token;
+        lookahead->ended = token.type == Token_CodeEnd;
+    }
+    if(target >= lookahead->lexed) target = lookahead->lexed - 1;
+    return lookahead->ring[target & (LOOKAHEAD_SIZE - 1)];
+}
+
+// Consumes and returns the next token; stays on Token_CodeEnd
+Token advanceToken(TokenLookahead* lookahead){
+    Token token = peekToken(lookahead, 0);
+    if(token.type != Token_CodeEnd) lookahead->position++;
+    return token;
+}
+
+// Checkpoint for resetLookahead()
+int markLookahead(const TokenLookahead* lookahead){
+    return lookahead->position;
+}
+
+// Moves back (or forward) to mark; false, without moving, if the tokens
+// there have already left the ring
+bool resetLookahead(TokenLookahead* lookahead, int mark){
+    if(mark > lookahead->lexed || lookahead->lexed - mark > LOOKAHEAD_SIZE) return false;
+    lookahead->position = mark;
+    return true;
+}
+//Token Lookahead
+
+//Token Writer
+// Formats a file's tokens for output without stdio. Text goes into a chain
+// of blocks that is sent with one writev per flush and kept for reuse. A
+// writer given an fd flushes by itself every WRITER_FLUSH_BLOCKS full
+// blocks; with fd -1 it collects everything until flushTokenWriter, so a
+// worker can format a whole file and leave the printing to another thread.
+// Formats:
+//   tsv     path:line, type name and lexeme, one per line; the path and
+//           the lexeme have \n \t \r \\ escaped
+//   json    one object per line: file, line, column, type, offset, length,
+//           text, plus error for Token_Unknown; well-formed UTF-8 passes
+//           through, and the bytes of a Diag_Invalid_Utf8 token or a
+//           malformed file name are written as \u00XX
+//   binary  the Binary Token Format image of each file, back to back
+typedef enum {
+    Output_Tsv,
+    Output_Json,
+    Output_Binary,
+    OUTPUT_FORMAT_COUNT
+} Output_Format;
+
+const char* outputFormatNames[OUTPUT_FORMAT_COUNT] = {"tsv", "json", "binary"};
+
+#define WRITER_FIRST_BLOCK 4096
+#define WRITER_MAX_BLOCK (256 * 1024)
+#define WRITER_IOV_MAX 64  // blocks per writev call
+#define WRITER_FLUSH_BLOCKS 16
+
+typedef struct WriterBlock {
+    struct WriterBlock* next;
+    size_t used;
+    size_t size;
+    char data[];
+} WriterBlock;
+
+typedef struct {
+    Output_Format format;
+    int fd;                 // flushed to automatically, or -1
+    WriterBlock* head;
+    WriterBlock* current;   // block being filled; blocks after it are spares
+    int filled;             // blocks filled since the last flush
+    long long written;      // bytes flushed so far
+    bool failed;            // out of memory or a write error
+} TokenWriter;
+
+typedef struct {
+    const char* text;
+    int length;
+} WriterName;
+
+// Type names padded to a fixed width so each is one constant-size copy
+#define WRITER_TYPE_NAME_SIZE 32
+static char writerTypeNames[TOKEN_TYPE_COUNT][WRITER_TYPE_NAME_SIZE];
+static unsigned char writerTypeNameLengths[TOKEN_TYPE_COUNT];
+static WriterName writerDiagnostics[DIAG_COUNT];
+// Escape letter per byte ('u' for \u00XX), 0 if the byte is copied as is
+static char tsvEscapes[256];
+static char jsonEscapes[256];
+// jsonEscapes plus every byte >= 0x80, for text that is not valid UTF-8
+static char jsonByteEscapes[256];
+static const char digitPairs[] =
+    "00010203040506070809101112131415161718192021222324252627282930313233343536373839"
+    "40414243444546474849505152535455565758596061626364656667686970717273747576777879"
+    "8081828384858687888990919293949596979899";
+static pthread_once_t writerTablesOnce = PTHREAD_ONCE_INIT;
+
+static void buildWriterTables(){
+    for(int t = 0; t < TOKEN_TYPE_COUNT; t++){
+        int length = (int)strlen(tokenTypeNames[t]);
+        if(length > WRITER_TYPE_NAME_SIZE) length = WRITER_TYPE_NAME_SIZE;
+        memcpy(writerTypeNames[t], tokenTypeNames[t], length);
+        writerTypeNameLengths[t] = (unsigned char)length;
+    }
+    for(int d = 0; d < DIAG_COUNT; d++){
+        const char* message = d ? diagnosticMessages[d] : "Unrecognized character";
+        writerDiagnostics[d].text = message;
+        writerDiagnostics[d].length = (int)strlen(message);
+    }
+    tsvEscapes['\n'] = 'n';
+    tsvEscapes['\t'] = 't';
+    tsvEscapes['\r'] = 'r';
+    tsvEscapes['\\'] = '\\';
+    for(int c = 0; c < 0x20; c++) jsonEscapes[c] = 'u';
+    jsonEscapes['\b'] = 'b';
+    jsonEscapes['\f'] = 'f';
+    jsonEscapes['\n'] = 'n';
+    jsonEscapes['\r'] = 'r';
+    jsonEscapes['\t'] = 't';
+    jsonEscapes['\"'] = '\"';
+    jsonEscapes['\\'] = '\\';
+    jsonEscapes[0x7F] = 'u';
+    memcpy(jsonByteEscapes, jsonEscapes, sizeof(jsonEscapes));
+    for(int c = 0x80; c < 0x100; c++) jsonByteEscapes[c] = 'u';
+}
+
+void initTokenWriter(TokenWriter* writer, Output_Format format, int fd){
+    pthread_once(&writerTablesOnce, buildWriterTables);
+    writer->format = format;
+    writer->fd = fd;
+    writer->head = NULL;
+    writer->current = NULL;
+    writer->filled = 0;
+    writer->written = 0;
+    writer->failed = false;
+}
+
+void freeTokenWriter(TokenWriter* writer){
+    WriterBlock* block = writer->head;
+    while(block){
+        WriterBlock* next = block->next;
+        free(block);
+        block = next;
+    }
+    writer->head = NULL;
+    writer->current = NULL;
+}
+
+// Bytes formatted and not yet flushed
+size_t pendingOutput(const TokenWriter* writer){
+    size_t total = 0;
+    for(WriterBlock* block = writer->head; block; block = block->next){
+        total += block->used;
+        if(block == writer->current) break;
+    }
+    return total;
+}
+
+bool flushTokenWriter(TokenWriter* writer, int fd);
+
+// Moves to a block with room for n bytes: a spare if it fits, otherwise a
+// new one twice the size of the last, up to WRITER_MAX_BLOCK. Everything
+// before the current block is committed, so this is where a writer with an
+// fd flushes.
+static char* nextWriterBlock(TokenWriter* writer, size_t n){
+    if(writer->fd >= 0 && ++writer->filled >= WRITER_FLUSH_BLOCKS){
+        if(!flushTokenWriter(writer, writer->fd)) return NULL;
+        if(writer->current->size >= n) return writer->current->data;
+    }
+    WriterBlock* last = writer->current;
+    if(last && last->next && last->next->size >= n){
+        writer->current = last->next;
+        return writer->current->data;
+    }
+    size_t size = last ? last->size * 2 : WRITER_FIRST_BLOCK;
+    if(size > WRITER_MAX_BLOCK) size = WRITER_MAX_BLOCK;
+    if(size < n) size = n;
+    WriterBlock* block = malloc(sizeof(WriterBlock) + size);
+    if(!block){
+        writer->failed = true;
+        return NULL;
+    }
+    block->used = 0;
+    block->size = size;
+    if(last){
+        block->next = last->next;
+        last->next = block;
+    }
+    else{
+        block->next = writer->head;
+        writer->head = block;
+    }
+    writer->current = block;
+    return block->data;
+}
+
+// Room for n contiguous bytes; fill it, then call commitWriter with the end
+static inline char* reserveWriter(TokenWriter* writer, size_t n){
+    WriterBlock* block = writer->current;
+    if(block && block->size - block->used >= n) return block->data + block->used;
+    return nextWriterBlock(writer, n);
+}
+
+static inline void commitWriter(TokenWriter* writer, const char* end){
+    writer->current->used = (size_t)(end - writer->current->data);
+}
+
+static bool writeBytes(TokenWriter* writer, const char* data, size_t length){
+    while(length > 0){
+        size_t n = length < WRITER_MAX_BLOCK ? length : WRITER_MAX_BLOCK;
+        WriterBlock* block = writer->current;
+        if(block && block->used < block->size && block->size - block->used < n) n = block->size - block->used;
+        char* out = reserveWriter(writer, n);
+        if(!out) return false;
+        memcpy(out, data, n);
+        commitWriter(writer, out + n);
+        data += n;
+        length -= n;
+    }
+    return true;
+}
+
+static inline char* putName(char* out, WriterName name){
+    memcpy(out, name.text, name.length);
+    return out + name.length;
+}
+
+// out needs WRITER_TYPE_NAME_SIZE bytes of room
+static inline char* putTypeName(char* out, Token_Type type){
+    memcpy(out, writerTypeNames[type], WRITER_TYPE_NAME_SIZE);
+    return out + writerTypeNameLengths[type];
+}
+
+// Decimal digits of value, written back to front two at a time
+static inline char* putDecimal(char* out, unsigned int value){
+    int digits = value < 10 ? 1 : value < 100 ? 2 : value < 1000 ? 3 : value < 10000 ? 4 :
+                 value < 100000 ? 5 : value < 1000000 ? 6 : value < 10000000 ? 7 :
+                 value < 100000000 ? 8 : value < 1000000000 ? 9 : 10;
+    char* at = out + digits;
+    while(value >= 100){
+        at -= 2;
+        memcpy(at, digitPairs + (value % 100) * 2, 2);
+        value /= 100;
+    }
+    if(value >= 10) memcpy(at - 2, digitPairs + value * 2, 2);
+    else at[-1] = (char)('0' + value);
+    return out + digits;
+}
+
+// Escapes text by the given table; out needs room for 6 bytes per input byte
+static char* putEscaped(char* out, const char* text, int length, const char escapes[256]){
+    static const char hexDigits[] = "0123456789abcdef";
+    int i = 0;
+    while(i < length){
+        int run = i;
+        while(run < length && !escapes[(unsigned char)text[run]]) run++;
+        memcpy(out, text + i, run - i);
+        out += run - i;
+        if(run == length) break;
+
+        unsigned char c = (unsigned char)text[run];
+        char escape = escapes[c];
+        i = run + 1;
+        *out++ = '\\';
+        *out++ = escape;
+        if(escape == 'u'){
+            *out++ = '0';
+            *out++ = '0';
+            *out++ = hexDigits[c >> 4];
+            *out++ = hexDigits[c & 0xF];
+        }
+    }
+    return out;
+}
+
+// Long text goes in slices that fit the current block where possible
+static bool writeEscaped(TokenWriter* writer, const char* text, int length, const char escapes[256]){
+    while(length > 0){
+        WriterBlock* block = writer->current;
+        size_t room = block ? block->size - block->used : 0;
+        int slice = length;
+        if((size_t)slice * 6 > room){
+            if(room >= 6 * 256) slice = (int)(room / 6);
+            else if(slice > WRITER_MAX_BLOCK / 6) slice = WRITER_MAX_BLOCK / 6;
+        }
+        char* out = reserveWriter(writer, (size_t)slice * 6);
+        if(!out) return false;
+        commitWriter(writer, putEscaped(out, text, slice, escapes));
+        text += slice;
+        length -= slice;
+    }
+    return true;
+}
+
+// path is the file name already escaped for TSV
+static bool writeTsvToken(TokenWriter* writer, const char* path, int pathLength, LineIndex* lines, Token token){
+    int line = 0;
+    resolveTokenPosition(lines, token, &line, NULL);
+    char* out = reserveWriter(writer, (size_t)pathLength + 64);
+    if(!out) return false;
+    memcpy(out, path, pathLength);
+    out += pathLength;
+    *out++ = ':';
+    out = putDecimal(out, (unsigned int)line);
+    *out++ = '\t';
+    out = putTypeName(out, token.type);
+    *out++ = '\t';
+    commitWriter(writer, out);
+    if(!writeEscaped(writer, lines->source + token.offset, token.length, tsvEscapes)) return false;
+
+    out = reserveWriter(writer, 1);
+    if(!out) return false;
+    *out++ = '\n';
+    commitWriter(writer, out);
+    return true;
+}
+
+// quotedPath is the file name already escaped and quoted for JSON
+static bool writeJsonToken(TokenWriter* writer, const char* quotedPath, int pathLength, LineIndex* lines, Token token){
+    int line = 0;
+    int column = 0;
+    resolveTokenPosition(lines, token, &line, &column);
+    char* out = reserveWriter(writer, (size_t)pathLength + 160);
+    if(!out) return false;
+    memcpy(out, "{\"file\":", 8);
+    out += 8;
+    memcpy(out, quotedPath, pathLength);
+    out += pathLength;
+    memcpy(out, ",\"line\":", 8);
+    out = putDecimal(out + 8, (unsigned int)line);
+    memcpy(out, ",\"column\":", 10);
+    out = putDecimal(out + 10, (unsigned int)column);
+    memcpy(out, ",\"type\":\"", 9);
+    out = putTypeName(out + 9, token.type);
+    memcpy(out, "\",\"offset\":", 11);
+    out = putDecimal(out + 11, (unsigned int)token.offset);
+    memcpy(out, ",\"length\":", 10);
+    out = putDecimal(out + 10, (unsigned int)token.length);
+    memcpy(out, ",\"text\":\"", 9);
+    commitWriter(writer, out + 9);
+    const char* escapes = token.diagnostic == Diag_Invalid_Utf8 ? jsonByteEscapes : jsonEscapes;
+    if(!writeEscaped(writer, lines->source + token.offset, token.length, escapes)) return false;
+
+    WriterName error = writerDiagnostics[token.type == Token_Unknown ? token.diagnostic : 0];
+    out = reserveWriter(writer, (size_t)error.length + 16);
+    if(!out) return false;
+    *out++ = '\"';
+    if(token.type == Token_Unknown){
+        memcpy(out, ",\"error\":\"", 10);
+        out = putName(out + 10, error);
+        *out++ = '\"';
+    }
+    *out++ = '}';
+    *out++ = '\n';
+    commitWriter(writer, out);
+    return true;
+}
+
+// Formats every token of stream up to Token_CodeEnd. lines must index the
+// source the stream was lexed from; path is only used by the text formats.
+bool writeTokens(TokenWriter* writer, const char* path, LineIndex* lines, const TokenStream* stream){
+    if(writer->failed) return false;
+    if(writer->format == Output_Binary){
+        size_t size;
+        unsigned char* image = encodeTokenStream(stream, &size);
+        if(!image){
+            writer->failed = true;
+            return false;
+        }
+        bool ok = writeBytes(writer, (const char*)image, size);
+        free(image);
+        return ok;
+    }
+
+    // escape the file name once, not per token: quoted for JSON, with
+    // tabs and line breaks escaped for TSV
+    int pathLength = (int)strlen(path);
+    char* prefix = malloc((size_t)pathLength * 6 + 2);
+    if(!prefix){
+        writer->failed = true;
+        return false;
+    }
+    char* out = prefix;
+    if(writer->format == Output_Json){
+        *out++ = '\"';
+        bool valid = scanners.validateUtf8(path, 0, pathLength) == pathLength;
+        out = putEscaped(out, path, pathLength, valid ? jsonEscapes : jsonByteEscapes);
+        *out++ = '\"';
+    }
+    else{
+        out = putEscaped(out, path, pathLength, tsvEscapes);
+    }
+    int prefixLength = (int)(out - prefix);
+
+    bool ok = true;
+    for(int i = 0; ok && i < stream->count; i++){
+        Token token = getToken(stream, i);
+        if(token.type == Token_CodeEnd) break;
+        if(writer->format == Output_Json) ok = writeJsonToken(writer, prefix, prefixLength, lines, token);
+        else ok = writeTsvToken(writer, prefix, prefixLength, lines, token);
+    }
+    free(prefix);
+    return ok;
+}
+
+// Sends everything formatted so far to fd and keeps the blocks for reuse
+bool flushTokenWriter(TokenWriter* writer, int fd){
+    struct iovec vectors[WRITER_IOV_MAX];
+    WriterBlock* end = writer->current ? writer->current->next : NULL;
+    WriterBlock* block = writer->head;
+    size_t skip = 0;    // bytes of block already written
+    bool ok = !writer->failed;
+    while(ok && block != end){
+        int count = 0;
+        for(WriterBlock* b = block; b != end && count < WRITER_IOV_MAX; b = b->next){
+            size_t from = b == block ? skip : 0;
+            if(b->used == from) continue;
+            vectors[count].iov_base = b->data + from;
+            vectors[count].iov_len = b->used - from;
+            count++;
+        }
+        if(count == 0) break;
+        ssize_t n = writev(fd, vectors, count);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0){
+            ok = false;
+            break;
+        }
+        writer->written += n;
+        size_t left = (size_t)n;
+        while(block != end && left >= block->used - skip){
+            left -= block->used - skip;
+            skip = 0;
+            block = block->next;
+        }
+        skip += left;
+    }
+
+    for(WriterBlock* b = writer->head; b != end; b = b->next) b->used = 0;
+    writer->current = writer->head;
+    writer->filled = 0;
+    if(!ok) writer->failed = true;
+    return ok;
+}
+//Token Writer
+
+//Benchmark
+// `lexical bench [--size MB] [--seed N] [--iterations N] [--threads N]
+//                [--mix identifier=30,keyword=15,...]`
+// Generates a synthetic corpus, times every engine over it and prints one
+// JSON object on stdout. Each engine keeps its best of --iterations runs.
+// Per-class ns/token comes from a single-class corpus for each class.
+// "skim" counts only the identifiers and keywords it returns, so compare
+// it with the others by mb_per_s.
+// "output" times every TokenWriter format over the pre-lexed mixed corpus
+// into /dev/null; its mb_per_s counts source bytes, so it compares
+// directly with the engines. "scanners" times the switch engine on comment
+// and string bodies with the scalar scanners and each vector set the CPU
+// has.
+typedef enum {
+    Bench_Identifier,
+    Bench_Keyword,
+    Bench_Number,
+    Bench_String,
+    Bench_Comment,
+    Bench_Operator,
+    Bench_Other,
+    BENCH_CLASS_COUNT
+} Bench_Class;
+
+#define BENCH_GENERATED_CLASSES Bench_Other  // the generator never emits Other
+
+const char* benchClassNames[] = {
+    "identifier", "keyword", "number", "string", "comment", "operator", "other"
+};
+
+static Bench_Class benchClassOf(Token_Type type){
+    switch(type){
+        case Token_Identifier: return Bench_Identifier;
+        case Token_Number: return Bench_Number;
+        case Token_Character:
+        case Token_String: return Bench_String;
+        case Token_Single_Line_Comment:
+        case Token_Block_Comment: return Bench_Comment;
+        case Token_Operator:
+        case Token_Delimeter:
+        case Token_Arithmetic_Operator:
+        case Token_Boolean_Operator:
+        case Token_Assignment_Operator:
+        case Token_Arithmetic_Operator_DIV: return Bench_Operator;
+        case Token_CodeEnd:
+        case Token_Unknown: return Bench_Other;
+        default:
+            return type >= Token_Delim_LPAR ? Bench_Operator : Bench_Keyword;
+    }
+}
+
+static unsigned int benchRandom(unsigned long long* state){
+    unsigned long long x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return (unsigned int)(x >> 32);
+}
+
+// One token of the given class at out; never writes more than 128 bytes
+static int benchEmit(char* out, Bench_Class class, unsigned long long* rng){
+    static const char identStart[] = "abcdefghijklmnopqrstuvwxyzABCDEFGHIJKLMNOPQRSTUVWXYZ_";
+    static const char identRest[] = "abcdefghijklmnopqrstuvwxyz0123456789_";
+    static const char text[] = "abcdefghijklmnopqrstuvwxyz ABCDEFGHIJ 0123456789 .,;:!?()+-*";
+    static const char* operators[] = {"(", ")", "[", "]", "{", "}", ",", "+", "-", "*", "/", "%", "^", "=", "=="};
+    int n = 0;
+    switch(class){
+        case Bench_Identifier: {
+            int length = 1 + benchRandom(rng) % 12;
+            out[n++] = identStart[benchRandom(rng) % (sizeof(identStart) - 1)];
+            while(n < length) out[n++] = identRest[benchRandom(rng) % (sizeof(identRest) - 1)];
+            break;
+        }
+        case Bench_Keyword: {
+            const char* word = keywords[benchRandom(rng) % KEYWORD_COUNT].word;
+            n = strlen(word);
+            memcpy(out, word, n);
+            break;
+        }
+        case Bench_Number: {
+            int length = 1 + benchRandom(rng) % 9;
+            while(n < length) out[n++] = '0' + benchRandom(rng) % 10;
+            // every fourth one is a decimal
+            if(benchRandom(rng) % 4 == 0){
+                out[n++] = '.';
+                length = n + 1 + benchRandom(rng) % 6;
+                while(n < length) out[n++] = '0' + benchRandom(rng) % 10;
+            }
+            break;
+        }
+        case Bench_String: {
+            if(benchRandom(rng) % 8 == 0){
+                out[n++] = '\'';
+                out[n++] = text[benchRandom(rng) % 26];
+                out[n++] = '\'';
+                break;
+            }
+            int length = benchRandom(rng) % 40;
+            out[n++] = '\"';
+            for(int i = 0; i < length; i++){
+                if(benchRandom(rng) % 16 == 0){
+                    out[n++] = '\\';
+                    out[n++] = 'n';
+                }
+                else{
+                    out[n++] = text[benchRandom(rng) % (sizeof(text) - 1)];
+                }
+            }
+            out[n++] = '\"';
+            break;
+        }
+        case Bench_Comment: {
+            bool block = benchRandom(rng) % 4 == 0;
+            int length = benchRandom(rng) % 60;
+            out[n++] = '~';
+            if(block) out[n++] = '/';
+            for(int i = 0; i < length; i++){
+                out[n++] = (block && i % 20 == 19) ? '\n' : text[benchRandom(rng) % (sizeof(text) - 1)];
+            }
+            if(block){
+                out[n++] = '/';
+                out[n++] = '~';
+            }
+            else{
+                out[n++] = '\n';
+            }
+            break;
+        }
+        default: {
+            const char* op = operators[benchRandom(rng) % (sizeof(operators) / sizeof(operators[0]))];
+            n = strlen(op);
+            memcpy(out, op, n);
+            break;
+        }
+    }
+    return n;
+}
+
+// Synthetic source of about size bytes, classes picked by weight
+char* generateBenchCorpus(int size, const int mix[BENCH_GENERATED_CLASSES], unsigned long long seed, int* length){
+    int total = 0;
+    for(int c = 0; c < BENCH_GENERATED_CLASSES; c++) total += mix[c];
+    char* corpus = malloc(size + 256);
+    if(!corpus || total <= 0){
+        free(corpus);
+        return NULL;
+    }
+
+    unsigned long long rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    int n = 0;
+    int onLine = 0;
+    while(n < size){
+        int pick = benchRandom(&rng) % total;
+        int class = 0;
+        while(pick >= mix[class]) pick -= mix[class++];
+        n += benchEmit(corpus + n, class, &rng);
+        // separators: mostly one space, a newline every few tokens, some runs
+        if(class == Bench_Comment && corpus[n - 1] == '\n'){
+            onLine = 0;
+        }
+        else if(++onLine >= 8 + (int)(benchRandom(&rng) % 8)){
+            corpus[n++] = '\n';
+            onLine = 0;
+        }
+        else if(benchRandom(&rng) % 16 == 0){
+            memcpy(corpus + n, "    ", 4);
+            n += 4;
+        }
+        else{
+            corpus[n++] = ' ';
+        }
+    }
+    *length = n;
+    return corpus;
+}
+
+typedef struct {
+    const char* source;
+    int length;
+    const char* path;   // the same corpus on disk, for the streaming engine
+    int threads;
+} BenchInput;
+
+typedef struct {
+    const TokenStream* tokens;
+    LineIndex* lines;
+    Output_Format format;
+    int fd;
+    long long bytes;    // output size of the last run
+} BenchOutput;
+
+// Each engine lexes the whole input and returns the token count, or -1
+typedef long long (*BenchEngine)(const BenchInput* input);
+
+static long long benchSwitch(const BenchInput* input){
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    long long count = 0;
+    Token token;
+    do{
+        token = getNextTokenSwitch(&lexer);
+        count++;
+    }while(token.type != Token_CodeEnd);
+    return count;
+}
+
+#ifdef LEXER_THREADED_DISPATCH
+static long long benchThreaded(const BenchInput* input){
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    long long count = 0;
+    Token token;
+    do{
+        token = getNextTokenThreaded(&lexer);
+        count++;
+    }while(token.type != Token_CodeEnd);
+    return count;
+}
+#endif
+
+static long long benchDfa(const BenchInput* input){
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    long long count = 0;
+    Token token;
+    do{
+        token = getNextTokenDfa(&lexer);
+        count++;
+    }while(token.type != Token_CodeEnd);
+    return count;
+}
+
+static long long benchTokenStream(const BenchInput* input){
+    TokenStream stream;
+    if(!tokenizeSource(input->source, input->length, &stream)) return -1;
+    long long count = stream.count;
+    freeTokenStream(&stream);
+    return count;
+}
+
+static long long benchParallel(const BenchInput* input){
+    TokenStream stream;
+    if(!tokenizeParallel(input->source, input->length, input->threads, &stream)) return -1;
+    long long count = stream.count;
+    freeTokenStream(&stream);
+    return count;
+}
+
+static long long benchStreaming(const BenchInput* input){
+    int fd = open(input->path, O_RDONLY);
+    if(fd < 0) return -1;
+    StreamLexer stream;
+    if(!initStreamLexer(&stream, fd, 64 * 1024)){
+        close(fd);
+        return -1;
+    }
+    long long count = 0;
+    Token token;
+    do{
+        token = getNextStreamToken(&stream);
+        count++;
+    }while(token.type != Token_CodeEnd);
+    bool failed = stream.failed;
+    freeStreamLexer(&stream);
+    close(fd);
+    return failed ? -1 : count;
+}
+
+// Consumer only counts, so this measures the hand-off overhead
+static long long benchPipeline(const BenchInput* input){
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    TokenPipeline pipeline;
+    if(!startTokenPipeline(&pipeline, &lexer)) return -1;
+    long long count = 0;
+    const Token* tokens;
+    int n;
+    while((n = nextPipelineBatch(&pipeline, &tokens)) > 0) count += n;
+    stopTokenPipeline(&pipeline);
+    return count;
+}
+
+// Identifiers and keywords only, as an indexer would lex
+static long long benchSkim(const BenchInput* input){
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    long long count = 0;
+    Token token;
+    do{
+        token = skimToken(&lexer, SKIM_WORD_TYPES);
+        count++;
+    }while(token.type != Token_CodeEnd);
+    return count;
+}
+
+typedef struct {
+    const char* name;
+    BenchEngine run;
+} BenchEngineEntry;
+
+const BenchEngineEntry benchEngines[] = {
+    {"switch", benchSwitch},
+#ifdef LEXER_THREADED_DISPATCH
+    {"threaded", benchThreaded},
+#endif
+    {"dfa", benchDfa},
+    {"token_stream", benchTokenStream},
+    {"parallel", benchParallel},
+    {"streaming", benchStreaming},
+    {"pipeline", benchPipeline},
+    {"skim", benchSkim},
+};
+#define BENCH_ENGINE_COUNT (int)(sizeof(benchEngines) / sizeof(benchEngines[0]))
+
+static double benchNow(){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec * 1e-9;
+}
+
+// Best wall time of iterations runs; *tokens gets the token count
+static double benchTime(BenchEngine run, const BenchInput* input, int iterations, long long* tokens){
+    double best = -1;
+    for(int i = 0; i < iterations; i++){
+        double start = benchNow();
+        long long count = run(input);
+        double elapsed = benchNow() - start;
+        if(count < 0) return -1;
+        *tokens = count;
+        if(best < 0 || elapsed < best) best = elapsed;
+    }
+    return best;
+}
+
+// Writes the corpus to a temporary file for the streaming engine
+static bool benchWriteCorpus(const char* source, int length, char* path){
+    strcpy(path, "/tmp/lexical-bench-XXXXXX");
+    int fd = mkstemp(path);
+    if(fd < 0) return false;
+    int written = 0;
+    while(written < length){
+        ssize_t n = write(fd, source + written, length - written);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) break;
+        written += (int)n;
+    }
+    close(fd);
+    if(written < length){
+        unlink(path);
+        return false;
+    }
+    return true;
+}
+
+static void benchPrintEngine(const char* name, double seconds, long long tokens, int bytes, bool last){
+    if(seconds <= 0){
+        printf("      {\"engine\": \"%s\", \"failed\": true}%s\n", name, last ? "" : ",");
+        return;
+    }
+    printf("      {\"engine\": \"%s\", \"seconds\": %.6f, \"tokens\": %lld, "
+           "\"mb_per_s\": %.2f, \"tokens_per_s\": %.0f, \"ns_per_token\": %.3f}%s\n",
+           name, seconds, tokens, bytes / seconds / 1e6, tokens / seconds,
+           seconds * 1e9 / tokens, last ? "" : ",");
+}
+
+// Formats every token and returns the token count, or -1
+static long long benchWriter(BenchOutput* output){
+    TokenWriter writer;
+    initTokenWriter(&writer, output->format, output->fd);
+    bool ok = writeTokens(&writer, "bench", output->lines, output->tokens) &&
+              flushTokenWriter(&writer, output->fd);
+    output->bytes = writer.written;
+    freeTokenWriter(&writer);
+    return ok ? output->tokens->count : -1;
+}
+
+static void benchPrintOutput(const BenchOutput* output, double seconds, long long tokens, int bytes, bool last){
+    const char* name = outputFormatNames[output->format];
+    if(seconds <= 0){
+        printf("      {\"format\": \"%s\", \"failed\": true}%s\n", name, last ? "" : ",");
+        return;
+    }
+    printf("      {\"format\": \"%s\", \"seconds\": %.6f, \"tokens\": %lld, \"output_bytes\": %lld, "
+           "\"mb_per_s\": %.2f, \"output_mb_per_s\": %.2f, \"ns_per_token\": %.3f}%s\n",
+           name, seconds, tokens, output->bytes, bytes / seconds / 1e6, output->bytes / seconds / 1e6,
+           seconds * 1e9 / tokens, last ? "" : ",");
+}
+
+// Parses "identifier=30,keyword=10,..."; unnamed classes keep their weight
+static bool benchParseMix(const char* spec, int mix[BENCH_GENERATED_CLASSES]){
+    while(*spec){
+        const char* equal = strchr(spec, '=');
+        if(!equal) return false;
+        int class = 0;
+        while(class < BENCH_GENERATED_CLASSES &&
+              (strncmp(benchClassNames[class], spec, equal - spec) != 0 || benchClassNames[class][equal - spec] != '\0')){
+            class++;
+        }
+        if(class == BENCH_GENERATED_CLASSES) return false;
+        char* end;
+        long weight = strtol(equal + 1, &end, 10);
+        if(end == equal + 1 || weight < 0 || weight > 1000) return false;
+        mix[class] = (int)weight;
+        spec = *end == ',' ? end + 1 : end;
+        if(*end != ',' && *end != '\0') return false;
+    }
+    return true;
+}
+
+int benchMain(int argc, char* argv[]){
+    int sizeMb = 16;
+    int iterations = 3;
+    unsigned long long seed = 1;
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    int mix[BENCH_GENERATED_CLASSES] = {30, 15, 15, 10, 5, 25};
+
+    for(int i = 0; i < argc; i++){
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = value != NULL;
+        if(ok && strcmp(argv[i], "--size") == 0) ok = (sizeMb = atoi(value)) > 0 && sizeMb <= 1024;
+        else if(ok && strcmp(argv[i], "--iterations") == 0) ok = (iterations = atoi(value)) > 0;
+        else if(ok && strcmp(argv[i], "--seed") == 0) seed = strtoull(value, NULL, 10);
+        else if(ok && strcmp(argv[i], "--threads") == 0) ok = (threads = atoi(value)) > 0;
+        else if(ok && strcmp(argv[i], "--mix") == 0) ok = benchParseMix(value, mix);
+        else ok = false;
+        if(!ok){
+            fprintf(stderr, "usage: bench [--size MB] [--iterations N] [--seed N] [--threads N] [--mix class=weight,...]\n");
+            return 2;
+        }
+        i++;
+    }
+    if(threads < 1) threads = 1;
+    initDfaTables();
+
+    int length;
+    char* corpus = generateBenchCorpus(sizeMb * 1024 * 1024, mix, seed, &length);
+    char path[32];
+    if(!corpus || !benchWriteCorpus(corpus, length, path)){
+        fprintf(stderr, "bench: cannot create corpus\n");
+        free(corpus);
+        return 1;
+    }
+    BenchInput input = {corpus, length, path, threads};
+
+    // class counts of the mixed corpus, from one untimed pass
+    long long classCounts[BENCH_CLASS_COUNT] = {0};
+    Lexer lexer;
+    initLexer(&lexer, corpus, length);
+    Token token;
+    do{
+        token = getNextToken(&lexer);
+        classCounts[benchClassOf(token.type)]++;
+    }while(token.type != Token_CodeEnd);
+
+    printf("{\n  \"corpus\": {\"bytes\": %d, \"seed\": %llu, \"threads\": %d, \"iterations\": %d, \"mix\": {",
+           length, seed, threads, iterations);
+    for(int c = 0; c < BENCH_GENERATED_CLASSES; c++){
+        printf("%s\"%s\": %d", c ? ", " : "", benchClassNames[c], mix[c]);
+    }
+    printf("}, \"tokens\": {");
+    for(int c = 0; c < BENCH_CLASS_COUNT; c++){
+        printf("%s\"%s\": %lld", c ? ", " : "", benchClassNames[c], classCounts[c]);
+    }
+    printf("}},\n  \"mixed\": [\n");
+    int status = 0;
+    for(int e = 0; e < BENCH_ENGINE_COUNT; e++){
+        long long tokens = 0;
+        double seconds = benchTime(benchEngines[e].run, &input, iterations, &tokens);
+        if(seconds < 0){
+            fprintf(stderr, "bench: %s engine failed\n", benchEngines[e].name);
+            status = 1;
+        }
+        benchPrintEngine(benchEngines[e].name, seconds, tokens, length, e == BENCH_ENGINE_COUNT - 1);
+    }
+
+    printf("  ],\n  \"output\": [\n");
+    TokenStream stream;
+    LineIndex lines;
+    initLineIndex(&lines, corpus, length);
+    int sink = open("/dev/null", O_WRONLY);
+    if(sink < 0 || !tokenizeSource(corpus, length, &stream)){
+        fprintf(stderr, "bench: cannot set up output\n");
+        if(sink >= 0) close(sink);
+        unlink(path);
+        free(corpus);
+        return 1;
+    }
+    for(int f = 0; f < OUTPUT_FORMAT_COUNT; f++){
+        BenchOutput output = {&stream, &lines, f, sink, 0};
+        double best = -1;
+        long long tokens = 0;
+        for(int i = 0; i < iterations; i++){
+            double start = benchNow();
+            tokens = benchWriter(&output);
+            double elapsed = benchNow() - start;
+            if(tokens < 0){
+                best = -1;
+                break;
+            }
+            if(best < 0 || elapsed < best) best = elapsed;
+        }
+        if(best < 0){
+            fprintf(stderr, "bench: %s output failed\n", outputFormatNames[f]);
+            status = 1;
+        }
+        benchPrintOutput(&output, best, tokens, length, f == OUTPUT_FORMAT_COUNT - 1);
+    }
+    close(sink);
+    freeLineIndex(&lines);
+    freeTokenStream(&stream);
+    printf("  ],\n  \"classes\": {\n");
+    unlink(path);
+    free(corpus);
+
+    // every class alone, at a quarter of the mixed size
+    for(int c = 0; c < BENCH_GENERATED_CLASSES && status == 0; c++){
+        int only[BENCH_GENERATED_CLASSES] = {0};
+        only[c] = 1;
+        corpus = generateBenchCorpus(sizeMb * 256 * 1024, only, seed, &length);
+        if(!corpus || !benchWriteCorpus(corpus, length, path)){
+            fprintf(stderr, "bench: cannot create corpus\n");
+            free(corpus);
+            status = 1;
+            break;
+        }
+        input.source = corpus;
+        input.length = length;
+        printf("    \"%s\": [\n", benchClassNames[c]);
+        for(int e = 0; e < BENCH_ENGINE_COUNT; e++){
+            long long tokens = 0;
+            double seconds = benchTime(benchEngines[e].run, &input, iterations, &tokens);
+            if(seconds < 0){
+                fprintf(stderr, "bench: %s engine failed\n", benchEngines[e].name);
+                status = 1;
+            }
+            benchPrintEngine(benchEngines[e].name, seconds, tokens, length, e == BENCH_ENGINE_COUNT - 1);
+        }
+        printf("    ]%s\n", c == BENCH_GENERATED_CLASSES - 1 ? "" : ",");
+        unlink(path);
+        free(corpus);
+    }
+
+    // the switch engine on comment and string bodies with every scanner
+    // set the CPU has, then back to the one selected at startup
+    printf("  },\n  \"scanners\": {\n");
+    pthread_once(&scannersOnce, selectScanners);
+    const char* selected = scannersInUse;
+    const Bench_Class scannerClasses[] = {Bench_Comment, Bench_String};
+    for(int c = 0; c < 2 && status == 0; c++){
+        int only[BENCH_GENERATED_CLASSES] = {0};
+        only[scannerClasses[c]] = 1;
+        corpus = generateBenchCorpus(sizeMb * 256 * 1024, only, seed, &length);
+        if(!corpus){
+            fprintf(stderr, "bench: cannot create corpus\n");
+            status = 1;
+            break;
+        }
+        input.source = corpus;
+        input.length = length;
+        printf("    \"%s\": [\n", benchClassNames[scannerClasses[c]]);
+        int last = SCANNER_SET_COUNT - 1;
+        while(last > 0 && !scannerSetSupported(&scannerSets[last])) last--;
+        for(int i = 0; i <= last; i++){
+            if(!useScanners(scannerSets[i].name)) continue;
+            char name[32];
+            snprintf(name, sizeof(name), "switch/%s", scannerSets[i].name);
+            long long tokens = 0;
+            double seconds = benchTime(benchSwitch, &input, iterations, &tokens);
+            benchPrintEngine(name, seconds, tokens, length, i == last);
+        }
+        printf("    ]%s\n", c == 1 ? "" : ",");
+        free(corpus);
+    }
+    useScanners(selected);
+    printf("  }\n}\n");
+#ifdef LEXER_STATS
+    writeLexerStats(stderr);
+#endif
+    return status;
+}
+//Benchmark
+
+//Self-Test
+// `lexical selftest [--rounds N] [--seed N] [--threads N]`
+// Lexes generated inputs and checks every engine against the switch
+// automaton, the reference the others are built to match. Rounds
+// alternate between the bench corpus and fragment soup full of malformed
+// UTF-8, unclosed literals, stray NULs and overlong numbers, each lexed
+// with and without unicodeIdentifiers; every 50th round is large enough
+// to be split into parallel chunks. Prints one line per check and exits
+// non-zero if any check saw a mismatch.
+#define SELF_TEST_LARGE (1 << 20)
+#define SELF_TEST_MAX_THREADS 64
+
+typedef struct {
+    const char* check;      // name of the running check, for messages
+    const char* source;
+    int length;
+    bool unicode;           // lex with unicodeIdentifiers set
+    int threads;
+    const Token* expected;  // the switch automaton's tokens, Token_CodeEnd last
+    int count;
+    unsigned long long rng; // for checks that pick edits or masks
+} SelfTestInput;
+
+// Each check returns false after reporting the first mismatch
+typedef bool (*SelfTestCheck)(SelfTestInput* input);
+
+static const char* selfTestPieces[] = {
+    "a", "bc", "_", "x9", "if", "elseif", "do", "DIV", "or", "and",
+    " ", "  ", "\t", "\r", "\n", "(", ")", ";", ",", "+", "-", "*", "/", "=", "==", ".",
+    "12", "3.5", "1.2.3", "99999999999999999999", "0.000000000000000000000001",
+    "\"", "\"a\\q", "\"x\\n\"", "'x'", "'\\n'", "'\\q", "'", "'\xc3\xa9'", "\\",
+    "~", "~~", "~/", "/~", "~ note\n",
+    "\xc3\xa9", "\xe2\x9c\x93", "\xf0\x9d\x84\x9e", "=\xc3\xa9", "\xff", "\xc3", "\x80", "\xe2\x9c", "\xed\xa0\x80"
+};
+#define SELF_TEST_PIECES (int)(sizeof(selfTestPieces) / sizeof(selfTestPieces[0]))
+
+// Fragments glued at random, at most size bytes; with nul set, sometimes
+// one byte becomes a NUL
+static int selfTestSoup(char* out, int size, bool nul, unsigned long long* rng){
+    int n = 0;
+    for(;;){
+        const char* piece = selfTestPieces[benchRandom(rng) % SELF_TEST_PIECES];
+        int length = strlen(piece);
+        if(n + length > size) break;
+        memcpy(out + n, piece, length);
+        n += length;
+    }
+    if(nul && n > 0 && benchRandom(rng) % 8 == 0) out[benchRandom(rng) % n] = '\0';
+    return n;
+}
+
+// The switch automaton's tokens for source, Token_CodeEnd included
+static Token* selfTestReference(const char* source, int length, bool unicode, int* count){
+    Lexer lexer;
+    initLexer(&lexer, source, length);
+    lexer.unicodeIdentifiers = unicode;
+    Token* tokens = NULL;
+    int capacity = 0;
+    *count = 0;
+    Token token;
+    do{
+        token = getNextTokenSwitch(&lexer);
+        if(*count == capacity){
+            capacity = capacity ? capacity * 2 : 256;
+            Token* grown = realloc(tokens, capacity * sizeof(Token));
+            if(!grown){
+                free(tokens);
+                return NULL;
+            }
+            tokens = grown;
+        }
+        tokens[(*count)++] = token;
+    }while(token.type != Token_CodeEnd);
+    return tokens;
+}
+
+static bool sameToken(Token a, Token b){
+    return a.type == b.type && a.diagnostic == b.diagnostic && a.flags == b.flags && a.offset == b.offset &&
+           a.length == b.length && a.symbol == b.symbol && a.value.integer == b.value.integer;
+}
+
+static bool selfTestMismatch(const SelfTestInput* input, int index, Token expected, Token actual){
+    fprintf(stderr, "selftest: %s%s: token %d: expected type %d at %d+%d (diagnostic %d), "
+                    "got type %d at %d+%d (diagnostic %d)\n",
+            input->check, input->unicode ? " (unicode identifiers)" : "", index,
+            expected.type, expected.offset, expected.length, expected.diagnostic,
+            actual.type, actual.offset, actual.length, actual.diagnostic);
+    return false;
+}
+
+typedef struct {
+    const SelfTestInput* input;
+    int mismatch;  // first token that differs, -1 if none
+    Token actual;
+} SelfTestLexRun;
+
+static void* selfTestLexThread(void* arg){
+    SelfTestLexRun* run = arg;
+    const SelfTestInput* input = run->input;
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    lexer.unicodeIdentifiers = input->unicode;
+    run->mismatch = -1;
+    for(int i = 0; i < input->count; i++){
+        Token token = getNextToken(&lexer);
+        if(!sameToken(token, input->expected[i])){
+            run->mismatch = i;
+            run->actual = token;
+            break;
+        }
+    }
+    freeLexer(&lexer);
+    return NULL;
+}
+
+// Lexers running on several threads at once each match the serial run
+static bool selfTestConcurrent(SelfTestInput* input){
+    int threads = input->threads < 2 ? 2 : input->threads;
+    pthread_t* ids = malloc(threads * sizeof(pthread_t));
+    SelfTestLexRun* runs = malloc(threads * sizeof(SelfTestLexRun));
+    if(!ids || !runs){
+        free(ids);
+        free(runs);
+        fprintf(stderr, "selftest: %s: out of memory\n", input->check);
+        return false;
+    }
+    int started = 0;
+    for(; started < threads; started++){
+        runs[started].input = input;
+        if(pthread_create(&ids[started], NULL, selfTestLexThread, &runs[started]) != 0) break;
+    }
+    for(int t = 0; t < started; t++) pthread_join(ids[t], NULL);
+    bool ok = started > 1;
+    if(!ok) fprintf(stderr, "selftest: %s: cannot start threads\n", input->check);
+    for(int t = 0; t < started && ok; t++){
+        if(runs[t].mismatch >= 0){
+            ok = selfTestMismatch(input, runs[t].mismatch, input->expected[runs[t].mismatch], runs[t].actual);
+        }
+    }
+    free(ids);
+    free(runs);
+    return ok;
+}
+
+// Pulls every token from next and compares it with the reference
+static bool selfTestEngine(SelfTestInput* input, Token (*next)(Lexer*)){
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    lexer.unicodeIdentifiers = input->unicode;
+    bool ok = true;
+    for(int i = 0; i < input->count && ok; i++){
+        Token token = next(&lexer);
+        if(!sameToken(token, input->expected[i])) ok = selfTestMismatch(input, i, input->expected[i], token);
+    }
+    freeLexer(&lexer);
+    return ok;
+}
+
+static bool selfTestDfa(SelfTestInput* input){
+    return selfTestEngine(input, getNextTokenDfa);
+}
+
+#ifdef LEXER_THREADED_DISPATCH
+static bool selfTestThreaded(SelfTestInput* input){
+    return selfTestEngine(input, getNextTokenThreaded);
+}
+#endif
+
+// The switch automaton with every scanner set the CPU has, then back to
+// the one the reference was lexed with
+static bool selfTestScanners(SelfTestInput* input){
+    const char* selected = scannersInUse;
+    bool ok = true;
+    for(int i = 0; i < SCANNER_SET_COUNT && ok; i++){
+        if(!useScanners(scannerSets[i].name)) continue;
+        ok = selfTestEngine(input, getNextTokenSwitch);
+        if(!ok) fprintf(stderr, "selftest: %s: with the %s scanners\n", input->check, scannerSets[i].name);
+    }
+    useScanners(selected);
+    return ok;
+}
+
+// Inputs below two parallel chunks take the serial tokenizeSource() path,
+// so this covers the TokenStream builder as well
+static bool selfTestParallel(SelfTestInput* input){
+    TokenStream stream;
+    if(!tokenizeParallel(input->source, input->length, input->threads, &stream)){
+        fprintf(stderr, "selftest: %s: tokenizeParallel failed\n", input->check);
+        return false;
+    }
+    bool ok = stream.count == input->count;
+    if(!ok){
+        fprintf(stderr, "selftest: %s: %d tokens, expected %d\n", input->check, stream.count, input->count);
+    }
+    for(int i = 0; i < input->count && ok; i++){
+        Token token = getToken(&stream, i);
+        if(!sameToken(token, input->expected[i])) ok = selfTestMismatch(input, i, input->expected[i], token);
+    }
+    freeTokenStream(&stream);
+    return ok;
+}
+
+// A window of a few dozen bytes, so refills and tokens longer than the
+// window are the common case. A number longer than the window is
+// documented to come back as Diag_Number_Overflow.
+static bool selfTestStreaming(SelfTestInput* input){
+    char path[32];
+    if(!benchWriteCorpus(input->source, input->length, path)){
+        fprintf(stderr, "selftest: %s: cannot write input\n", input->check);
+        return false;
+    }
+    int fd = open(path, O_RDONLY);
+    unlink(path);
+    StreamLexer stream;
+    int windowSize = STREAM_MIN_WINDOW + (int)(benchRandom(&input->rng) % 192);
+    if(fd < 0 || !initStreamLexer(&stream, fd, windowSize)){
+        if(fd >= 0) close(fd);
+        fprintf(stderr, "selftest: %s: cannot open input\n", input->check);
+        return false;
+    }
+    stream.lexer.unicodeIdentifiers = input->unicode;
+    bool ok = true;
+    for(int i = 0; i < input->count && ok; i++){
+        Token token = getNextStreamToken(&stream);
+        token.offset += (int)stream.windowBase;
+        Token expected = input->expected[i];
+        bool longNumber = token.diagnostic == Diag_Number_Overflow && expected.length >= windowSize &&
+                          token.offset == expected.offset;
+        if(!longNumber && !sameToken(token, expected)) ok = selfTestMismatch(input, i, expected, token);
+    }
+    if(ok && stream.failed){
+        fprintf(stderr, "selftest: %s: read error\n", input->check);
+        ok = false;
+    }
+    freeStreamLexer(&stream);
+    close(fd);
+    return ok;
+}
+
+// Lexes a random variant of the input, edits it back into the input and
+// relexes: the result must match a full lex of the input
+static bool selfTestRelex(SelfTestInput* input){
+    bool ok = true;
+    for(int edit = 0; edit < 3 && ok; edit++){
+        char fragment[64];
+        int inserted = selfTestSoup(fragment, (int)(benchRandom(&input->rng) % sizeof(fragment)), false, &input->rng);
+        LexerEdit change;
+        change.offset = (int)(benchRandom(&input->rng) % (input->length + 1));
+        change.insertedLength = (int)(benchRandom(&input->rng) % 32);
+        if(change.insertedLength > input->length - change.offset) change.insertedLength = input->length - change.offset;
+        change.deletedLength = inserted;
+
+        // old = input with [offset, offset + insertedLength) replaced by fragment
+        int oldLength = input->length - change.insertedLength + inserted;
+        char* old = malloc(oldLength + 1);
+        TokenStream stream;
+        if(old){
+            memcpy(old, input->source, change.offset);
+            memcpy(old + change.offset, fragment, inserted);
+            memcpy(old + change.offset + inserted, input->source + change.offset + change.insertedLength,
+                   input->length - change.offset - change.insertedLength);
+        }
+        if(!old || !tokenizeSource(old, oldLength, &stream)){
+            free(old);
+            fprintf(stderr, "selftest: %s: out of memory\n", input->check);
+            return false;
+        }
+        if(!relexEdit(&stream, input->source, input->length, &change)){
+            freeTokenStream(&stream);
+            free(old);
+            fprintf(stderr, "selftest: %s: out of memory\n", input->check);
+            return false;
+        }
+        ok = stream.count == input->count;
+        if(!ok){
+            fprintf(stderr, "selftest: %s: %d tokens after the edit at %d, expected %d\n",
+                    input->check, stream.count, change.offset, input->count);
+        }
+        for(int i = 0; i < input->count && ok; i++){
+            Token token = getToken(&stream, i);
+            if(!sameToken(token, input->expected[i])) ok = selfTestMismatch(input, i, input->expected[i], token);
+        }
+        freeTokenStream(&stream);
+        free(old);
+    }
+    return ok;
+}
+
+// skimToken() must return the reference stream filtered by its mask
+static bool selfTestSkim(SelfTestInput* input){
+    unsigned long long masks[] = {
+        SKIM_WORD_TYPES, TOKEN_BIT(Token_Identifier), SKIM_WORD_TYPES | TOKEN_BIT(Token_Unknown),
+        TOKEN_BIT(Token_String), TOKEN_BIT(Token_Number) | TOKEN_BIT(Token_Block_Comment), 0, ~0ULL,
+        ((unsigned long long)benchRandom(&input->rng) << 32) | benchRandom(&input->rng)
+    };
+    bool ok = true;
+    for(int m = 0; m < (int)(sizeof(masks) / sizeof(masks[0])) && ok; m++){
+        Lexer lexer;
+        initLexer(&lexer, input->source, input->length);
+        lexer.unicodeIdentifiers = input->unicode;
+        for(int i = 0; i < input->count && ok; i++){
+            Token expected = input->expected[i];
+            if(expected.type != Token_CodeEnd && !(masks[m] & TOKEN_BIT(expected.type))) continue;
+            Token token = skimToken(&lexer, masks[m]);
+            if(!sameToken(token, expected)){
+                fprintf(stderr, "selftest: %s: mask %llx\n", input->check, masks[m]);
+                ok = selfTestMismatch(input, i, expected, token);
+            }
+        }
+        freeLexer(&lexer);
+    }
+    return ok;
+}
+
+// Lexes with a symbol table, encodes the stream and reads it back through
+// both the cursor and loadTokenStream(). Identifiers must come back with
+// their own names, and a corrupted copy must either fail to load or keep
+// every span inside the source.
+static bool selfTestTokenFile(SelfTestInput* input){
+    SymbolTable symbols, loaded;
+    if(!initSymbolTable(&symbols)) return false;
+    if(!initSymbolTable(&loaded)){
+        freeSymbolTable(&symbols);
+        return false;
+    }
+    Lexer lexer;
+    initLexer(&lexer, input->source, input->length);
+    lexer.unicodeIdentifiers = input->unicode;
+    lexer.symbols = &symbols;
+    TokenStream stream, copy;
+    size_t size = 0;
+    unsigned char* data = NULL;
+    TokenFile tokens;
+    bool ok = tokenizeLexer(&lexer, &stream);
+    if(ok){
+        data = encodeTokenStream(&stream, &size);
+        freeTokenStream(&stream);
+    }
+    ok = data && initTokenFile(&tokens, data, size) && loadTokenFileSymbols(&tokens, &loaded);
+    if(!ok) fprintf(stderr, "selftest: %s: cannot encode or reopen the stream\n", input->check);
+
+    TokenFileCursor cursor;
+    if(ok) initTokenFileCursor(&cursor, &tokens);
+    for(int i = 0; i < input->count && ok; i++){
+        Token expected = input->expected[i];
+        Token token;
+        if(!nextFileToken(&cursor, &token)){
+            fprintf(stderr, "selftest: %s: file ends at token %d of %d\n", input->check, i, input->count);
+            ok = false;
+            break;
+        }
+        if(expected.type == Token_Identifier){
+            int length;
+            const char* name = token.symbol && token.symbol <= loaded.count ? symbolName(&loaded, token.symbol, &length) : NULL;
+            if(!name || length != expected.length || memcmp(name, input->source + expected.offset, length) != 0){
+                fprintf(stderr, "selftest: %s: token %d has the wrong symbol\n", input->check, i);
+                ok = false;
+            }
+        }
+        token.symbol = 0;
+        if(token.type == Token_Number){
+            // not stored, see nextFileToken
+            token.value = expected.value;
+            token.flags = expected.flags;
+        }
+        if(ok && !sameToken(token, expected)) ok = selfTestMismatch(input, i, expected, token);
+    }
+
+    if(ok){
+        // a failed load leaves the stream for the caller to free
+        if(!loadTokenStream(&tokens, input->source, &copy)){
+            fprintf(stderr, "selftest: %s: loadTokenStream failed\n", input->check);
+            ok = false;
+        }
+        for(int i = 0; i < input->count && ok; i++){
+            Token token = getToken(&copy, i);
+            token.symbol = 0;
+            if(!sameToken(token, input->expected[i])) ok = selfTestMismatch(input, i, input->expected[i], token);
+        }
+        freeTokenStream(&copy);
+    }
+
+    // flip a few bytes past the header: load or not, never out of bounds
+    for(int round = 0; round < 4 && ok && size > TOKEN_FILE_HEADER_SIZE; round++){
+        unsigned char* corrupt = malloc(size);
+        if(!corrupt) break;
+        memcpy(corrupt, data, size);
+        for(int flip = 0; flip < 3; flip++){
+            size_t at = TOKEN_FILE_HEADER_SIZE + benchRandom(&input->rng) % (size - TOKEN_FILE_HEADER_SIZE);
+            corrupt[at] ^= (unsigned char)(1 + benchRandom(&input->rng) % 255);
+        }
+        TokenFile bad;
+        if(initTokenFile(&bad, corrupt, size)){
+            bool loaded = loadTokenStream(&bad, input->source, &copy);
+            for(int i = 0; i < copy.count && loaded && ok; i++){
+                Token token = getToken(&copy, i);
+                if(token.offset < 0 || token.offset + token.length > input->length){
+                    fprintf(stderr, "selftest: %s: a corrupt file loaded a span outside the source\n", input->check);
+                    ok = false;
+                }
+            }
+            freeTokenStream(&copy);
+        }
+        free(corrupt);
+    }
+
+    free(data);
+    freeLexer(&lexer);
+    freeSymbolTable(&symbols);
+    freeSymbolTable(&loaded);
+    return ok;
+}
+
+typedef struct {
+    const char* name;
+    SelfTestCheck run;
+    bool unicode;  // also run with unicodeIdentifiers set
+} SelfTestEntry;
+
+const SelfTestEntry selfTests[] = {
+    {"concurrent", selfTestConcurrent, true},
+    {"dfa", selfTestDfa, true},
+    {"scanners", selfTestScanners, true},
+#ifdef LEXER_THREADED_DISPATCH
+    {"threaded", selfTestThreaded, true},
+#endif
+    {"parallel", selfTestParallel, false},
+    {"streaming", selfTestStreaming, true},
+    {"relex", selfTestRelex, false},
+    {"token_file", selfTestTokenFile, true},
+    {"skim", selfTestSkim, true},
+};
+#define SELF_TEST_COUNT (int)(sizeof(selfTests) / sizeof(selfTests[0]))
+
+int selfTestMain(int argc, char* argv[]){
+    int rounds = 200;
+    unsigned long long seed = 1;
+    int threads = 4;
+
+    for(int i = 0; i < argc; i++){
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        bool ok = value != NULL;
+        if(ok && strcmp(argv[i], "--rounds") == 0) ok = (rounds = atoi(value)) > 0;
+        else if(ok && strcmp(argv[i], "--seed") == 0) seed = strtoull(value, NULL, 10);
+        else if(ok && strcmp(argv[i], "--threads") == 0) ok = (threads = atoi(value)) > 0 && threads <= SELF_TEST_MAX_THREADS;
+        else ok = false;
+        if(!ok){
+            fprintf(stderr, "usage: selftest [--rounds N] [--seed N] [--threads N]\n");
+            return 2;
+        }
+        i++;
+    }
+
+    int mix[BENCH_GENERATED_CLASSES] = {30, 15, 15, 10, 5, 25};
+    unsigned long long rng = seed ? seed : 0x9E3779B97F4A7C15ULL;
+    int inputs[SELF_TEST_COUNT] = {0};
+    bool failed[SELF_TEST_COUNT] = {false};
+    for(int r = 0; r < rounds; r++){
+        bool large = r % 50 == 49;
+        int size = large ? SELF_TEST_LARGE : (int)(benchRandom(&rng) % 4096);
+        int length = 0;
+        char* source;
+        if(r % 2 == 0){
+            source = malloc(size + 1);
+            if(source) length = selfTestSoup(source, size, !large, &rng);
+        }
+        else{
+            source = generateBenchCorpus(size + 1, mix, seed + r, &length);
+        }
+        if(!source){
+            fprintf(stderr, "selftest: out of memory\n");
+            return 1;
+        }
+
+        for(int unicode = 0; unicode < 2; unicode++){
+            int count;
+            Token* expected = selfTestReference(source, length, unicode, &count);
+            if(!expected){
+                fprintf(stderr, "selftest: out of memory\n");
+                free(source);
+                return 1;
+            }
+            for(int t = 0; t < SELF_TEST_COUNT; t++){
+                if(failed[t] || (unicode && !selfTests[t].unicode)) continue;
+                SelfTestInput input = {selfTests[t].name, source, length, unicode, threads,
+                                       expected, count, rng ^ (unsigned long long)t};
+                failed[t] = !selfTests[t].run(&input);
+                inputs[t]++;
+            }
+            free(expected);
+        }
+        free(source);
+    }
+
+    int status = 0;
+    for(int t = 0; t < SELF_TEST_COUNT; t++){
+        printf("%-12s %s (%d inputs)\n", selfTests[t].name, failed[t] ? "FAIL" : "ok", inputs[t]);
+        if(failed[t]) status = 1;
+    }
+    return status;
+}
+//Self-Test
+
+//Batch Driver
+// `lexical [-j N] [-q] [--unicode-identifiers] [--format tsv|json|binary] [--cache DIR] [--cache-size MB] [--read-ahead N] PATH...`
+// Lexes every file given, descending into directories, on a pool of
+// worker threads. Each worker owns a deque of files and steals from the
+// others once its own runs dry; files are dealt out largest first so a
+// few huge files do not leave the pool idle at the end. While it lexes
+// one file, each worker keeps up to --read-ahead more from its own deque
+// reading (default 2, at most 16, 0 for blocking reads). Tokens go
+// through a per-file TokenWriter and are printed in input order, and a
+// file's Token_Unknown diagnostics are reported without stopping the
+// batch.
+typedef struct {
+    char* data;
+    size_t length;
+    size_t capacity;
+} OutputBuffer;
+
+static bool reserveOutput(OutputBuffer* buffer, size_t extra){
+    if(buffer->length + extra <= buffer->capacity) return true;
+    size_t capacity = buffer->capacity ? buffer->capacity : 4096;
+    while(capacity < buffer->length + extra) capacity *= 2;
+    char* data = realloc(buffer->data, capacity);
+    if(!data) return false;
+    buffer->data = data;
+    buffer->capacity = capacity;
+    return true;
+}
+
+static bool printOutput(OutputBuffer* buffer, const char* format, ...) __attribute__((format(printf, 2, 3)));
+static bool printOutput(OutputBuffer* buffer, const char* format, ...){
+    va_list args;
+    va_start(args, format);
+    int n = vsnprintf(NULL, 0, format, args);
+    va_end(args);
+    if(n < 0 || !reserveOutput(buffer, (size_t)n + 1)) return false;
+    va_start(args, format);
+    vsnprintf(buffer->data + buffer->length, (size_t)n + 1, format, args);
+    va_end(args);
+    buffer->length += (size_t)n;
+    return true;
+}
+
+typedef struct {
+    char* path;
+    long long size;
+    TokenWriter output;
+    OutputBuffer errors;
+    bool failed;
+    atomic_bool done;
+} BatchFile;
+
+// Files are claimed from the bottom by the owner and stolen from the top
+typedef struct {
+    pthread_mutex_t lock;
+    int* items;
+    int top;
+    int bottom;
+} WorkDeque;
+
+typedef struct {
+    BatchFile* files;
+    int fileCount;
+    WorkDeque* deques;
+    int workerCount;
+    bool quiet;
+    bool unicodeIdentifiers;
+    int readAhead;  // files each worker reads through io_uring beyond the one it lexes, 0 for blocking reads
+    Output_Format format;
+    TokenCache* cache;
+    pthread_mutex_t doneLock;
+    pthread_cond_t doneSignal;
+} BatchJob;
+
+typedef struct {
+    BatchJob* job;
+    int id;
+} BatchWorker;
+
+static int popWork(WorkDeque* deque){
+    int item = -1;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top) item = deque->items[--deque->bottom];
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+static int stealWork(WorkDeque* deque){
+    int item = -1;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->bottom > deque->top) item = deque->items[deque->top++];
+    pthread_mutex_unlock(&deque->lock);
+    return item;
+}
+
+static void lexBatchFile(BatchJob* job, BatchFile* file, SourceFile source){
+    Lexer lexer;
+    initLexer(&lexer, source.data, source.length);
+    lexer.unicodeIdentifiers = job->unicodeIdentifiers;
+    TokenStream stream;
+    bool ok = job->cache ? tokenizeCached(job->cache, &lexer, &stream) : tokenizeLexer(&lexer, &stream);
+    if(!ok){
+        printOutput(&file->errors, "%s: error: out of memory\n", file->path);
+        file->failed = true;
+        return;
+    }
+
+    LineIndex lines;
+    initLineIndex(&lines, source.data, source.length);
+    for(int i = 0; i < stream.count; i++){
+        Token token = getToken(&stream, i);
+        if(token.type == Token_CodeEnd) break;
+        if(token.type == Token_Unknown){
+            const char* message = token.diagnostic ? diagnosticMessages[token.diagnostic] : "Unrecognized character";
+            int line = 0;
+            int column = 0;
+            resolveTokenPosition(&lines, token, &line, &column);
+            printOutput(&file->errors, "%s:%d:%d: error: %s\n", file->path, line, column, message);
+            file->failed = true;
+        }
+    }
+    if(!job->quiet && !writeTokens(&file->output, file->path, &lines, &stream)){
+        printOutput(&file->errors, "%s: error: out of memory\n", file->path);
+        file->failed = true;
+    }
+    freeLineIndex(&lines);
+    freeTokenStream(&stream);
+}
+
+static int claimWork(BatchJob* job, int id){
+    int item = popWork(&job->deques[id]);
+    for(int k = 1; item < 0 && k < job->workerCount; k++){
+        item = stealWork(&job->deques[(id + k) % job->workerCount]);
+    }
+    return item;
+}
+
+// Keeps up to readAhead files reading beyond the one it lexes, taking them
+// only from its own deque: a file is stolen only when nothing is in
+// flight, so files not yet being read stay stealable by idle workers
+static void* batchWorker(void* arg){
+    BatchWorker* worker = arg;
+    BatchJob* job = worker->job;
+    ReadAhead ahead;
+    int depth = job->readAhead + 1;
+    if(!initReadAhead(&ahead, depth, job->readAhead > 0)) depth = 0;
+    for(;;){
+        int item = -1;
+        while(depth > 0 && !readAheadFull(&ahead)){
+            // nothing is ever queued again, so an idle worker that finds
+            // every deque empty is finished
+            item = readAheadEmpty(&ahead) ? claimWork(job, worker->id) : popWork(&job->deques[worker->id]);
+            if(item < 0) break;
+            submitReadAhead(&ahead, job->files[item].path, item);
+        }
+
+        SourceFile source;
+        int error = 0;
+        int slot = -1;
+        if(depth > 0){
+            slot = nextReadAhead(&ahead, &item, &source, &error);
+            if(slot < 0) break;
+        }
+        else{
+            // no memory for a read-ahead pool: open each file in turn
+            if((item = claimWork(job, worker->id)) < 0) break;
+            errno = 0;
+            if(!openSourceFile(job->files[item].path, &source)) error = errno ? errno : EIO;
+        }
+
+        BatchFile* file = &job->files[item];
+        if(error){
+            printOutput(&file->errors, "%s: error: %s\n", file->path, strerror(error));
+            file->failed = true;
+        }
+        else{
+            lexBatchFile(job, file, source);
+        }
+        if(slot >= 0) releaseReadAhead(&ahead, slot);
+        else if(!error) closeSourceFile(&source);
+        pthread_mutex_lock(&job->doneLock);
+        atomic_store(&file->done, true);
+        pthread_cond_broadcast(&job->doneSignal);
+        pthread_mutex_unlock(&job->doneLock);
+    }
+    if(depth > 0) freeReadAhead(&ahead);
+    return NULL;
+}
+
+typedef struct {
+    char** paths;
+    int count;
+    int capacity;
+} PathList;
+
+static bool addPath(PathList* list, char* path){
+    if(list->count == list->capacity){
+        int capacity = list->capacity ? list->capacity * 2 : 64;
+        char** paths = realloc(list->paths, capacity * sizeof(char*));
+        if(!paths) return false;
+        list->paths = paths;
+        list->capacity = capacity;
+    }
+    list->paths[list->count++] = path;
+    return true;
+}
+
+static int comparePaths(const void* a, const void* b){
+    return strcmp(*(char* const*)a, *(char* const*)b);
+}
+
+// Adds the regular files under directory, sorted so the order is stable;
+// symlinked directories are not followed, and FIFOs, sockets and devices
+// are skipped
+static void collectDirectory(const char* directory, PathList* list, OutputBuffer* errors){
+    DIR* dir = opendir(directory);
+    if(!dir){
+        printOutput(errors, "%s: error: %s\n", directory, strerror(errno));
+        return;
+    }
+    PathList entries = {0};
+    struct dirent* entry;
+    while((entry = readdir(dir))){
+        if(strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
+        size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+        char* path = malloc(length);
+        if(!path) break;
+        snprintf(path, length, "%s/%s", directory, entry->d_name);
+        if(!addPath(&entries, path)) free(path);
+    }
+    closedir(dir);
+
+    qsort(entries.paths, entries.count, sizeof(char*), comparePaths);
+    for(int i = 0; i < entries.count; i++){
+        struct stat info;
+        if(lstat(entries.paths[i], &info) != 0){
+            // gone or unreadable since readdir
+            printOutput(errors, "%s: error: %s\n", entries.paths[i], strerror(errno));
+            free(entries.paths[i]);
+            continue;
+        }
+        if(S_ISDIR(info.st_mode)){
+            collectDirectory(entries.paths[i], list, errors);
+            free(entries.paths[i]);
+        }
+        // only regular files, directly or through a symlink: a FIFO or
+        // device found on the walk would block the batch on open or read
+        else if(S_ISREG(info.st_mode) || (S_ISLNK(info.st_mode) && stat(entries.paths[i], &info) == 0 && S_ISREG(info.st_mode))){
+            if(!addPath(list, entries.paths[i])) free(entries.paths[i]);
+        }
+        else{
+            free(entries.paths[i]);
+        }
+    }
+    free(entries.paths);
+}
+
+typedef struct {
+    long long size;
+    int index;
+} SizedFile;
+
+static int compareBySizeDescending(const void* a, const void* b){
+    const SizedFile* x = a;
+    const SizedFile* y = b;
+    if(x->size != y->size) return x->size < y->size ? 1 : -1;
+    return x->index - y->index;
+}
+
+static void writeAll(int fd, const char* data, size_t length){
+    while(length > 0){
+        ssize_t n = write(fd, data, length);
+        if(n < 0 && errno == EINTR) continue;
+        if(n <= 0) return;
+        data += n;
+        length -= (size_t)n;
+    }
+}
+
+int driverMain(int argc, char* argv[]){
+    int threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    bool quiet = false;
+    bool unicodeIdentifiers = false;
+    int readAhead = 2;
+    Output_Format format = Output_Tsv;
+    const char* cacheDirectory = NULL;
+    long long cacheMb = 256;
+    PathList list = {0};
+    OutputBuffer errors = {0};
+    bool options = true;
+
+    for(int i = 0; i < argc; i++){
+        const char* arg = argv[i];
+        const char* value = i + 1 < argc ? argv[i + 1] : NULL;
+        if(options && arg[0] == '-' && arg[1] != '\0'){
+            bool ok = true;
+            if(strcmp(arg, "--") == 0) options = false;
+            else if(strcmp(arg, "-q") == 0 || strcmp(arg, "--quiet") == 0) quiet = true;
+            else if(strcmp(arg, "--unicode-identifiers") == 0) unicodeIdentifiers = true;
+            else if(strcmp(arg, "-j") == 0 && value){ threads = atoi(value); i++; ok = threads > 0; }
+            else if(strncmp(arg, "-j", 2) == 0){ threads = atoi(arg + 2); ok = threads > 0; }
+            else if(strcmp(arg, "--format") == 0 && value){
+                format = 0;
+                while(format < OUTPUT_FORMAT_COUNT && strcmp(outputFormatNames[format], value) != 0) format++;
+                ok = format < OUTPUT_FORMAT_COUNT;
+                i++;
+            }
+            else if(strcmp(arg, "--cache") == 0 && value){ cacheDirectory = value; i++; }
+            else if(strcmp(arg, "--cache-size") == 0 && value){ cacheMb = atoll(value); i++; ok = cacheMb > 0; }
+            else if(strcmp(arg, "--read-ahead") == 0 && value){ readAhead = atoi(value); i++; ok = readAhead >= 0 && readAhead <= READ_AHEAD_MAX_FILES; }
+            else ok = false;
+            if(!ok){
+                fprintf(stderr, "usage: lexical [-j N] [-q] [--unicode-identifiers] [--format tsv|json|binary] [--cache DIR] [--cache-size MB] [--read-ahead N] PATH...\n"
+                                "       lexical bench [options]\n"
+                                "       lexical selftest [options]\n");
+                return 2;
+            }
+            continue;
+        }
+        struct stat info;
+        if(strcmp(arg, "-") != 0 && stat(arg, &info) == 0 && S_ISDIR(info.st_mode)){
+            collectDirectory(arg, &list, &errors);
+        }
+        else{
+            char* path = strdup(arg);
+            if(path && !addPath(&list, path)) free(path);
+        }
+    }
+    if(list.count == 0 && errors.length == 0){
+        fprintf(stderr, "usage: lexical [-j N] [-q] [--unicode-identifiers] [--format tsv|json|binary] [--cache DIR] [--cache-size MB] [--read-ahead N] PATH...\n"
+                        "       lexical bench [options]\n"
+                        "       lexical selftest [options]\n");
+        return 2;
+    }
+    writeAll(STDERR_FILENO, errors.data, errors.length);
+    bool failed = errors.length > 0;
+    free(errors.data);
+
+    TokenCache cache;
+    TokenCache* cacheInUse = NULL;
+    if(cacheDirectory){
+        if(initTokenCache(&cache, cacheDirectory, cacheMb * 1024 * 1024)) cacheInUse = &cache;
+        else fprintf(stderr, "%s: warning: cache unavailable, lexing without it\n", cacheDirectory);
+    }
+
+    BatchFile* files = calloc(list.count ? list.count : 1, sizeof(BatchFile));
+    SizedFile* order = malloc((list.count ? list.count : 1) * sizeof(SizedFile));
+    if(threads > list.count) threads = list.count > 0 ? list.count : 1;
+    WorkDeque* deques = calloc(threads, sizeof(WorkDeque));
+    if(!files || !order || !deques){
+        fprintf(stderr, "lexical: out of memory\n");
+        return 1;
+    }
+    for(int i = 0; i < list.count; i++){
+        struct stat info;
+        files[i].path = list.paths[i];
+        files[i].size = stat(list.paths[i], &info) == 0 ? (long long)info.st_size : 0;
+        initTokenWriter(&files[i].output, format, -1);
+        atomic_init(&files[i].done, false);
+        order[i].size = files[i].size;
+        order[i].index = i;
+    }
+
+    // largest first, dealt round-robin so every deque starts with big work
+    qsort(order, list.count, sizeof(SizedFile), compareBySizeDescending);
+    for(int w = 0; w < threads; w++){
+        pthread_mutex_init(&deques[w].lock, NULL);
+        deques[w].items = malloc((list.count / threads + 1) * sizeof(int));
+        deques[w].top = 0;
+        deques[w].bottom = 0;
+        if(!deques[w].items){
+            fprintf(stderr, "lexical: out of memory\n");
+            return 1;
+        }
+    }
+    // owners pop from the bottom, so the biggest files go in last
+    for(int i = list.count - 1; i >= 0; i--){
+        WorkDeque* deque = &deques[i % threads];
+        deque->items[deque->bottom++] = order[i].index;
+    }
+
+    BatchJob job = { files, list.count, deques, threads, quiet, unicodeIdentifiers, readAhead, format, cacheInUse,
+                     PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+    pthread_t* workers = malloc(threads * sizeof(pthread_t));
+    BatchWorker* contexts = malloc(threads * sizeof(BatchWorker));
+    int started = 0;
+    for(; workers && contexts && started < threads; started++){
+        contexts[started].job = &job;
+        contexts[started].id = started;
+        if(pthread_create(&workers[started], NULL, batchWorker, &contexts[started]) != 0) break;
+    }
+    if(started == 0){
+        // no thread could start: this one steals every deque empty
+        BatchWorker self = { &job, 0 };
+        batchWorker(&self);
+    }
+
+    // print in input order as files finish
+    for(int i = 0; i < list.count; i++){
+        BatchFile* file = &files[i];
+        pthread_mutex_lock(&job.doneLock);
+        while(!atomic_load(&file->done)) pthread_cond_wait(&job.doneSignal, &job.doneLock);
+        pthread_mutex_unlock(&job.doneLock);
+        flushTokenWriter(&file->output, STDOUT_FILENO);
+        writeAll(STDERR_FILENO, file->errors.data, file->errors.length);
+        failed = failed || file->failed;
+        freeTokenWriter(&file->output);
+        free(file->errors.data);
+        free(file->path);
+    }
+    for(int t = 0; t < started; t++) pthread_join(workers[t], NULL);
+
+    for(int w = 0; w < threads; w++){
+        pthread_mutex_destroy(&deques[w].lock);
+        free(deques[w].items);
+    }
+    if(cacheInUse) freeTokenCache(cacheInUse);
+    free(workers);
+    free(contexts);
+    free(deques);
+    free(order);
+    free(files);
+    free(list.paths);
+    return failed ? 1 : 0;
+}
+//Batch Driver
+
+int main(int argc, char* argv[]){
+    if(argc > 1 && strcmp(argv[1], "bench") == 0) return benchMain(argc - 2, argv + 2);
+    if(argc > 1 && strcmp(argv[1], "selftest") == 0) return selfTestMain(argc - 2, argv + 2);
+    return driverMain(argc - 1, argv + 1);
+}